@@ -0,0 +1,27 @@
+#include <iostream>
+#include <algorithm>
+#include <thread>
+#include "opencv2/core.hpp"
+#include "imgAdjustGolden.h"
+
+using namespace std;
+using namespace cv;
+using namespace imgadjust;
+
+
+// Golden checks of every kernel, single-threaded and on all cores, for
+// ctest; exits with 1 if any check failed
+int main()
+{
+    int counts[2] = { 1, std::max(2, (int)thread::hardware_concurrency()) };
+    int failed = 0;
+    for (int t = 0; t < 2; t++)
+    {
+        setNumThreads(counts[t]);
+        cout << "golden checks, " << counts[t] << " threads" << endl;
+        failed += runGoldenSets();
+    }
+
+    cout << failed << " golden checks failed" << endl;
+    return failed ? 1 : 0;
+}
@@ -1,299 +1,42 @@
 #include <iostream>  
+#include <fstream>
+#include <sstream>
 #include <string>  
+#include <vector>
+#include <deque>
+#include <list>
+#include <map>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <memory>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <cerrno>
+#include <csignal>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "opencv2/core.hpp"  
 #include "opencv2/imgproc.hpp"  
 #include "opencv2/highgui.hpp"  
+#include "imgAdjustLib.h"
+#include "imgAdjustGolden.h"
   
 using namespace std;  
 using namespace cv;  
-  
-  
-#define SWAP(a, b, t)  do { t = a; a = b; b = t; } while(0)  
-#define CLIP_RANGE(value, min, max)  ( (value) > (max) ? (max) : (((value) < (min)) ? (min) : (value)) )  
-#define COLOR_RANGE(value)  CLIP_RANGE(value, 0, 255)  
-  
-/** 
- * Adjust Brightness and Contrast 
- * 
- * @param src [in] InputArray 
- * @param dst [out] OutputArray 
- * @param brightness [in] integer, value range [-255, 255] 
- * @param contrast [in] integer, value range [-255, 255] 
- * 
- * @return 0 if success, else return error code 
- */  
-int adjustBrightnessContrast(Mat& src, Mat& dst, int brightness, int contrast)  
-{  
-    //Mat input = src.getMat();  
-    //if( input.empty() ) {  
-    //    return -1;  
-    //}  
-  
-    dst.create(src.size(), src.type());  
-    //Mat output = dst.getMat();  
-  
-    brightness = CLIP_RANGE(brightness, -255, 255);  
-    contrast = CLIP_RANGE(contrast, -255, 255);  
-  
-    /** 
-    Algorithm of Brightness Contrast transformation 
-    The formula is: 
-        y = [x - 127.5 * (1 - B)] * k + 127.5 * (1 + B); 
- 
-        x is the input pixel value 
-        y is the output pixel value 
-        B is brightness, value range is [-1,1] 
-        k is used to adjust contrast 
-            k = tan( (45 + 44 * c) / 180 * PI ); 
-            c is contrast, value range is [-1,1] 
-    */  
-  
-    double B = brightness / 255.;  
-    double c = contrast / 255. ;  
-    double k = tan( (45 + 44 * c) / 180 * M_PI );  
-  
-    Mat lookupTable(1, 256, CV_8U);  
-    uchar *p = lookupTable.data;  
-    for (int i = 0; i < 256; i++)  
-        p[i] = COLOR_RANGE( (i - 127.5 * (1 - B)) * k + 127.5 * (1 + B) );  
-  
-    LUT(src, lookupTable, dst);  
-  
-    return 0;  
-}  
-
-// L:0~255, A:0~255, B:0~255  
-void AdjustLAB(Mat& img, Mat& aImg, int  l, int a, int b)  
-{  
-    if ( aImg.empty())    
-        aImg.create(img.rows, img.cols, img.type());      
-  
-    Mat temp;  
-    temp.create(img.rows, img.cols, img.type());      
-  
-    cvtColor(img, temp, CV_BGR2Lab);      
-  
-    int i, j;  
-    Size size = img.size();  
-    int chns = img.channels();  
-  
-    if (temp.isContinuous())  
-    {  
-        size.width *= size.height;   
-        size.height = 1;  
-    }  
-  
-    // ֤Χ  
-    if ( l<-255 )  
-        l = -255;  
-  
-    if ( a<-255)  
-        a = -255;  
-  
-    if ( b<-255 )  
-        b = -255;  
-  
-    if ( l>255)  
-        l = 255;  
-  
-    if ( a>255)  
-        a = 255;  
-  
-    if ( b>255)  
-        b = 255;  
-  
-  
-    for (  i= 0; i<size.height; ++i)  
-    {         
-        unsigned char* src = (unsigned char*)temp.data+temp.step*i;  
-        for (  j=0; j<size.width; ++j)  
-        {  
-            float val = src[j*chns]+l;  
-            if ( val < 0) val = 0.0;  
-            if ( val > 255 ) val = 255;  
-            src[j*chns] = val;  
-  
-            val = src[j*chns+1]+a;  
-            if ( val < 0) val = 0;  
-            if ( val > 255 ) val = 255;  
-            src[j*chns+1] = val;  
-              
-            val = src[j*chns+2]+b;  
-            if ( val < 0) val = 0;  
-            if ( val > 255 ) val = 255;  
-            src[j*chns+2] = val;                          
-        }  
-    }     
-  
-    cvtColor(temp, aImg, CV_Lab2BGR);  
-    if ( temp.empty())  
-        temp.release();  
-      
-}  
-
-// H:0~180, S:0~255, V:0~255  
-void AdjustHSI(Mat& img, Mat& aImg, int  hue, int saturation, int ilumination)  
-{  
-    if ( aImg.empty())    
-        aImg.create(img.rows, img.cols, img.type());      
-  
-    Mat temp;  
-    temp.create(img.rows, img.cols, img.type());      
-  
-    cvtColor(img, temp, CV_BGR2HSV);      
-  
-    int i, j;  
-    Size size = img.size();  
-    int chns = img.channels();  
-  
-    if (temp.isContinuous())  
-    {  
-        size.width *= size.height;   
-        size.height = 1;  
-    }  
-  
-    // ֤Χ  
-    if ( hue<-180 )  
-        hue = -180;  
-  
-    if ( saturation<-255)  
-        saturation = -255;  
-  
-    if ( ilumination<-255 )  
-        ilumination = -255;  
-  
-    if ( hue>180)  
-        hue = 180;  
-  
-    if ( saturation>255)  
-        saturation = 255;  
-  
-    if ( ilumination>255)  
-        ilumination = 255;  
-  
-  
-    for (  i= 0; i<size.height; ++i)  
-    {         
-        unsigned char* src = (unsigned char*)temp.data+temp.step*i;  
-        for (  j=0; j<size.width; ++j)  
-        {  
-            float val = src[j*chns]+hue;  
-            if ( val < 0) val = 0.0;  
-            if ( val > 180 ) val = 180;  
-            src[j*chns] = val;  
-  
-            val = src[j*chns+1]+saturation;  
-            if ( val < 0) val = 0;  
-            if ( val > 255 ) val = 255;  
-            src[j*chns+1] = val;  
-              
-            val = src[j*chns+2]+ilumination;  
-            if ( val < 0) val = 0;  
-            if ( val > 255 ) val = 255;  
-            src[j*chns+2] = val;                          
-        }  
-    }     
-  
-    cvtColor(temp, aImg, CV_HSV2BGR);  
-    if ( temp.empty())  
-        temp.release();  
-      
-}  
-
-void ColorBalance(Mat& img, Mat& cbImg, int cR, int cG, int cB)  
-{  
-    if ( cbImg.empty())   
-        cbImg.create(img.rows, img.cols, img.type());    
-  
-    //cbImg = cv::Scalar::all(0);  
-  
-    int i, j;  
-    Size size = img.size();  
-    int chns = img.channels();  
-  
-    if (img.isContinuous() && cbImg.isContinuous())  
-    {   
-        size.width *= size.height;   
-        size.height = 1;  
-    }   
-    
-    // ֤Χ  
-    if ( cR<-255 )   
-        cR = -255;  
-  
-    if ( cG<-255 )   
-        cG = -255;  
-  
-    if ( cB<-255 )   
-        cB = -255;  
-  
-    if ( cR>255)  
-        cR = 255;  
-  
-    if ( cG>255)  
-        cG = 255;  
-  
-    if ( cB>255)  
-        cB = 255;  
-  
-  
-    for (  i= 0; i<size.height; ++i)  
-    {   
-        const unsigned char* src = (const unsigned char*)(img.data+ img.step*i);  
-        unsigned char* dst = (unsigned char*)cbImg.data+cbImg.step*i;  
-        for (  j=0; j<size.width; ++j)  
-        {
-            dst[j*chns] = saturate_cast<uchar>(src[j*chns] +cR);  
-            dst[j*chns+1] = saturate_cast<uchar>(src[j*chns+1] +cG);  
-            dst[j*chns+2] = saturate_cast<uchar>(src[j*chns+2] +cB);    
-        }
-    }    
-}  
-
-// Gamma [0.1, 5.0]  
-void GammaCorrect(Mat& img, Mat& cImg, float ga)  
-{  
-    if ( cImg.empty())    
-        cImg.create(img.rows, img.cols, img.type());          
-  
-    //cImg = cv::Scalar::all(0);  
-  
-    int i, j;  
-    Size size = img.size();  
-    int chns = img.channels();  
-  
-    if (img.isContinuous() && cImg.isContinuous())  
-    {  
-        size.width *= size.height;   
-        size.height = 1;  
-    }  
-  
-    // ֤Χ  
-    ga = ga / 10.0;
-    if ( ga<0.1) ga = -0.1;  
-    if ( ga> 5.0) ga = 5.0;      
-  
-    // ٣ұ  
-    unsigned char lut[256];    
-    for(  i = 0; i < 256; i++ )    
-    {    
-        lut[i] = saturate_cast<uchar>(cv::pow((float)(i/255.0), ga) * 255.0f);    
-    }   
-  
-    for (  i= 0; i<size.height; ++i)  
-    {  
-        const unsigned char* src = (const unsigned char*)(img.data+ img.step*i);  
-        unsigned char* dst = (unsigned char*)cImg.data+cImg.step*i;  
-        for (  j=0; j<size.width; ++j)  
-        {                     
-            dst[j*chns] = lut[src[j*chns]];  
-            dst[j*chns+1] = lut[src[j*chns+1]];  
-            dst[j*chns+2] = lut[src[j*chns+2]];       
-        }  
-    }     
-} 
-
+using namespace imgadjust;
 
+#define CLIP_RANGE(value, min, max)  ( (value) > (max) ? (max) : (((value) < (min)) ? (min) : (value)) )
+#define COLOR_RANGE(value)  CLIP_RANGE(value, 0, 255)
   
 
 //=====ʼ====  
@@ -303,7 +46,6 @@ static string window_src = "src";
 static string window_img = "image";  
 static Mat src;  
 static Mat dst;  
-static Mat mask;  
 static int brightness = 255;  
 static int contrast = 255;  
   
@@ -321,6 +63,16 @@ static int cB = 255;
 
 static int ga= 10;
 
+static int region = REGION_ALL;
+static int feather = 0;
+
+static Mat proxy;
+static Mat proxyDst;
+static MaskCache srcMask;
+static bool fullPending = false;
+static int64 lastChange = 0;
+static const double settleSec = 0.3;
+
 
 static void callbackAdjust_bright(int , void *)  
 {  
@@ -341,148 +93,147 @@ static void callbackAdjust_ColorBalance(int , void *)
 }  
 
 
-int getMask(Mat& img, Mat& mask)
-{
-    Size size = img.size();  
-    int chns = img.channels();  
-
-    Mat temp;  
-    temp.create(img.rows, img.cols, img.type());      
-    cvtColor(img, temp, CV_BGR2HSV);      
-
-    for (int i= 0; i<size.height; ++i)  
-    {   
-        const unsigned char* src = (const unsigned char*)(img.data+ img.step*i);  
-        const unsigned char* hsv = (const unsigned char*)(temp.data+ temp.step*i);  
-        unsigned char* dst = (unsigned char*)mask.data+mask.step*i;  
-        for (int j=0; j<size.width; ++j)  
-        {
-            if ((saturate_cast<uchar>(src[j*chns])<200 || saturate_cast<uchar>(src[j*chns+1])<200 || saturate_cast<uchar>(src[j*chns+2])<200) && (saturate_cast<uchar>(hsv[j*chns])<30 || 180 - saturate_cast<uchar>(hsv[j*chns])<20))
-            {
-                dst[j*chns] = 255;  
-                dst[j*chns+1] = 255;  
-                dst[j*chns+2] = 255;       
-            }
-        }
-    }    
 
-    return 0;
+  
+static AdjustParams trackbarParams()
+{
+    AdjustParams p;
+    p.brightness = brightness - 255;
+    p.contrast = contrast - 255;
+    p.l = l - 255;
+    p.a = a - 255;
+    p.b = b - 255;
+    p.hue = hue - 180;
+    p.saturation = saturation - 255;
+    p.ilumination = ilumination - 255;
+    p.cR = cR - 255;
+    p.cG = cG - 255;
+    p.cB = cB - 255;
+    p.ga = ga;
+    p.region = region;
+    p.feather = feather;
+    return p;
 }
 
-
-float* getRGB(Mat& img)
+// Smallest pyrDown level of img that still covers img scaled to fit in
+// width x height, the size a KEEPRATIO window shows it at; a wide or tall
+// image is fitted by its long side, so it is still reduced
+static Mat previewProxy(const Mat& img, int width, int height)
 {
-    float *rgb = new float[3];
-    for (int i=0; i<3; i++)
+    double scale = std::min(1.0, std::min((double)width / img.cols, (double)height / img.rows));
+    int fitCols = (int)ceil(img.cols * scale);
+    int fitRows = (int)ceil(img.rows * scale);
+
+    Mat level = img;
+    while (level.cols / 2 >= fitCols && level.rows / 2 >= fitRows)
     {
-        rgb[i] = 0;
+        Mat next;
+        pyrDown(level, next);
+        level = next;
     }
+    return level;
+}
 
-    Size size = img.size();  
-    int chns = img.channels();  
-
-    mask.create(img.size(), img.type());  
-    getMask(src, mask);
-    Mat grayMask = Mat::zeros(img.size(), CV_8UC1);
-    cvtColor(mask, grayMask, CV_BGR2GRAY);      
-
-    CvScalar cs;  
-    cs = mean(img, grayMask);  
-
-    rgb[0] = cs.val[2];
-    rgb[1] = cs.val[1];
-    rgb[2] = cs.val[0];
-
-    return rgb;
+// Largest of the sampling error bounds of stats
+static float maxErr(const AdjustStats& stats)
+{
+    float err = 0;
+    for (int c = 0; c < 3; c++)
+        err = std::max(err, std::max(stats.rgbErr[c], std::max(stats.labErr[c], stats.hsvErr[c])));
+    return err;
 }
-  
-float* getLAB(Mat& img)
+
+// Every step-th pixel of every step-th row of img, the grid getStats
+// samples with the same step
+static Mat sampleGrid(const Mat& img, int step)
 {
-    float *lab = new float[3];
-    for (int i=0; i<3; i++)
+    Mat out((img.rows + step - 1) / step, (img.cols + step - 1) / step, img.type());
+    size_t es = img.elemSize();
+    for (int i = 0; i < out.rows; i++)
     {
-        lab[i] = 0;
+        const uchar* p = img.ptr<uchar>(i * step);
+        uchar* q = out.ptr<uchar>(i);
+        for (int j = 0; j < out.cols; j++)
+            memcpy(q + j*es, p + (size_t)j*step*es, es);
     }
-
-    Mat temp;  
-    temp.create(img.rows, img.cols, img.type());      
-    cvtColor(img, temp, CV_BGR2Lab);      
-
-    Size size = img.size();  
-    int chns = img.channels();  
-
-    mask = Mat::zeros(img.size(), img.type());
-    getMask(src, mask);
-    Mat grayMask = Mat::zeros(img.size(), CV_8UC1);
-    cvtColor(mask, grayMask, CV_BGR2GRAY);      
-    //imwrite("grayMask.jpg", grayMask);
-
-    CvScalar cs;  
-    cs = mean(temp, grayMask);  
-
-    lab[0] = cs.val[0];
-    lab[1] = cs.val[1];
-    lab[2] = cs.val[2];
-
-    if ( temp.empty())  
-        temp.release();  
-      
-    return lab;
+    return out;
 }
-  
-float* getHSV(Mat& img)
+
+/**
+ * Sampled statistics of the full resolution result, while dragging
+ *
+ * Every stage of the chain and the region blend is per pixel, so running
+ * them on the statsStep grid of src gives exactly the pixels getStats
+ * would sample from the adjusted frame, without rendering it. The *Err
+ * bounds are then the sampling error against the full resolution means.
+ * The grid, its mask and the region weights are kept until src or the
+ * region sliders change.
+ */
+static AdjustStats sampledStats(const AdjustParams& p)
 {
-    float *hsv = new float[3];
-    for (int i=0; i<3; i++)
+    static const uchar* gridData = 0;
+    static int gridStep = 1, gridRegion = -1, gridFeather = -1;
+    static Mat gridSrc, gridMask, gridWeight;
+
+    if (gridData != src.data)
     {
-        hsv[i] = 0;
+        gridStep = statsStep(src);
+        gridSrc = sampleGrid(src, gridStep);
+        gridMask = sampleGrid(srcMask.get(src), gridStep);
+        gridData = src.data;
+        gridRegion = -1;
+    }
+    if (p.region != REGION_ALL && (p.region != gridRegion || p.feather != gridFeather))
+    {
+        Mat weight;
+        regionWeight(srcMask.get(src), p.region, p.feather, weight);
+        gridWeight = sampleGrid(weight, gridStep);
+        gridRegion = p.region;
+        gridFeather = p.feather;
     }
 
-    Mat temp;  
-    temp.create(img.rows, img.cols, img.type());      
-    cvtColor(img, temp, CV_BGR2HSV);      
-
-    Size size = img.size();  
-    int chns = img.channels();  
-
-    mask = Mat::zeros(img.size(), img.type());
-    getMask(src, mask);
-    Mat grayMask = Mat::zeros(img.size(), CV_8UC1);
-    cvtColor(mask, grayMask, CV_BGR2GRAY);      
-    //imwrite("grayMask.jpg", grayMask);
-
-    CvScalar cs;  
-    cs = mean(temp, grayMask);  
-
-    hsv[0] = cs.val[0];
-    hsv[1] = cs.val[1];
-    hsv[2] = cs.val[2];
+    Mat gridDst;
+    AdjustGraph(p).run(gridSrc, gridDst);
+    if (p.region != REGION_ALL)
+        blendRegion(gridSrc, gridDst, gridWeight, gridDst);
 
-    if ( temp.empty())  
-        temp.release();  
-      
-    return hsv;
+    long long total[STATS_SUMS] = { 0 };
+    addStats(gridDst, gridMask, 1, total);
+    return statsFromSums(total, gridStep);
 }
-  
-static void callbackAdjust(int , void *)  
+
+// Full resolution render with the statistics readout
+static void renderFull()
 {  
-    adjustBrightnessContrast(src, dst, brightness - 255, contrast - 255);  
-    AdjustLAB(dst, dst, l-255, a-255, b-255);
-    AdjustHSI(dst, dst, hue-180, saturation-255, ilumination-255);
-    ColorBalance(dst, dst, cB - 255, cG - 255, cR - 255);
-    GammaCorrect(dst, dst, ga);
+    IMGADJUST_PROFILE_SCOPE("renderFull");
+    AdjustParams p = trackbarParams();
+    static AdjustCache renderCache;
+    renderCache.render(src, p, dst);
+    fullPending = false;
     
-    float *rgb = NULL;
-    rgb = getRGB(dst);
+    const Mat& mask = srcMask.get(src);
+    if ( p.region != REGION_ALL )
+    {
+        PooledMat weight(scratchPool(), src.rows, src.cols, CV_8UC1);
+        regionWeight(mask, p.region, p.feather, weight.mat);
+        blendRegion(src, dst, weight.mat, dst);
+    }
+
+    AdjustStats stats = getStats(dst, mask);
+    const float* rgb = stats.rgb;
+    const float* lab = stats.lab;
+    const float* hsv = stats.hsv;
+
     Point ptRGB(5,dst.size().height/10);
     stringstream ss;
     ss << "RGB:" << rgb[0] << "," << rgb[1] << "," << rgb[2];
     string strRGB = ss.str();
-    putText(dst,strRGB,ptRGB,CV_FONT_HERSHEY_COMPLEX,1,Scalar(0,0,255),1,1);
+    {
+        IMGADJUST_PROFILE_SCOPE("putText");
+        putText(dst,strRGB,ptRGB,CV_FONT_HERSHEY_COMPLEX,1,Scalar(0,0,255),1,1);
+    }
     cout << strRGB << endl;
 
-    float *lab = NULL;
-    lab = getLAB(dst);
     Point ptLAB(5,dst.size().height*3/10);
     stringstream ssLAB;
     ssLAB << "LAB:" << lab[0] << "," << lab[1] << "," << lab[2];
@@ -490,8 +241,6 @@ static void callbackAdjust(int , void *)
     //putText(dst,strLAB,ptRGB,CV_FONT_HERSHEY_COMPLEX,1,Scalar(0,0,255),1,1);
     cout << strLAB << endl;
 
-    float *hsv = NULL;
-    hsv = getHSV(dst);
     Point ptHSV(5,dst.size().height*6/10);
     stringstream ssHSV;
     ssHSV << "HSV:" << hsv[0] << "," << hsv[1] << "," << hsv[2];
@@ -504,58 +253,2375 @@ static void callbackAdjust(int , void *)
     string strRst = ssRst.str();
     cout << strRst << endl << endl;
 
-    delete rgb;
-    rgb = NULL;
-    delete lab;
-    lab = NULL;
-    delete hsv;
-    hsv = NULL;
-
+    IMGADJUST_PROFILE_OVERLAY(dst);
+    IMGADJUST_PROFILE_SCOPE("imshow");
     imshow(window_img, dst);  
+}
+
+// While a slider moves only the preview-sized proxy is rendered, the full
+// resolution image follows once the sliders have been still for a moment
+static void callbackAdjust(int , void *)
+{
+    IMGADJUST_PROFILE_SCOPE("callbackAdjust");
+    if ( proxy.data == src.data )
+    {
+        renderFull();
+        return;
+    }
+
+    AdjustParams p = trackbarParams();
+    static AdjustCache proxyCache;
+    proxyCache.render(proxy, p, proxyDst);
+
+    static MaskCache proxyMask;
+    const Mat& mask = proxyMask.get(proxy);
+    if ( p.region != REGION_ALL )
+    {
+        // feather is given in full resolution pixels
+        PooledMat weight(scratchPool(), proxy.rows, proxy.cols, CV_8UC1);
+        regionWeight(mask, p.region, p.feather * proxy.cols / src.cols, weight.mat);
+        blendRegion(proxy, proxyDst, weight.mat, proxyDst);
+    }
+
+    // sampled readout while dragging, taken from the full resolution image
+    // rather than the blurred proxy, so the bound covers all of its error;
+    // renderFull prints the exact one
+    AdjustStats stats = sampledStats(p);
+    cout << "~rst:" << stats.rgb[0] << "," << stats.rgb[1] << "," << stats.rgb[2] << ","
+         << stats.lab[0] << "," << stats.lab[1] << "," << stats.lab[2] << ","
+         << stats.hsv[0] << "," << stats.hsv[1] << "," << stats.hsv[2] << " +-" << maxErr(stats) << endl;
+
+    IMGADJUST_PROFILE_OVERLAY(proxyDst);
+    {
+        IMGADJUST_PROFILE_SCOPE("imshow");
+        imshow(window_img, proxyDst);
+    }
+
+    fullPending = true;
+    lastChange = getTickCount();
 }  
   
-  
-int main(int argc, char** argv)  
-{  
-    char * filename = "test.jpg";
-    if(argc > 1)
-    {   
-        filename = argv[1];
-    } 
+//===== headless batch mode ====
 
-    src = imread(filename);  
-  
-    if ( !src.data ) {  
-        cout << "error read image" << endl;  
-        return -1;  
-    }  
-    dst.create(src.size(), src.type());  
-  
-    namedWindow(window_name, CV_WINDOW_NORMAL| CV_WINDOW_KEEPRATIO| CV_GUI_EXPANDED);  
-    namedWindow(window_src, CV_WINDOW_NORMAL| CV_WINDOW_KEEPRATIO| CV_GUI_EXPANDED);  
-    namedWindow(window_img, CV_WINDOW_NORMAL| CV_WINDOW_KEEPRATIO| CV_GUI_EXPANDED);  
-    resizeWindow(window_img, 1024, 1080);
-    createTrackbar("brightness", window_name, &brightness, 2*brightness, callbackAdjust);  
-    createTrackbar("contrast", window_name, &contrast, 2*contrast, callbackAdjust);  
+// Whole-string decimal integer, false on junk, overflow or an empty string
+static bool parseInt(const string& s, int& value)
+{
+    char* end = 0;
+    errno = 0;
+    long v = strtol(s.c_str(), &end, 10);
+    if (s.empty() || *end != '\0' || errno == ERANGE || v < INT_MIN || v > INT_MAX)
+        return false;
+    value = (int)v;
+    return true;
+}
 
-    createTrackbar("l", window_name, &l, 2*l, callbackAdjust);  
-    createTrackbar("a", window_name, &a, 2*a, callbackAdjust);  
-    createTrackbar("b", window_name, &b, 2*b, callbackAdjust);  
+static bool parseDouble(const string& s, double& value)
+{
+    char* end = 0;
+    errno = 0;
+    double v = strtod(s.c_str(), &end);
+    if (s.empty() || *end != '\0' || errno == ERANGE)
+        return false;
+    value = v;
+    return true;
+}
 
-    createTrackbar("h", window_name, &hue, 2*hue, callbackAdjust);  
-    createTrackbar("s", window_name, &saturation, 2*saturation, callbackAdjust);  
-    createTrackbar("i", window_name, &ilumination, 2*ilumination, callbackAdjust);  
+// Set one chain parameter by trackbar name, values are offsets as in
+// AdjustParams (0 is neutral, ga is in tenths with 10 neutral)
+static bool setParam(AdjustParams& p, const string& key, int value)
+{
+    if (key == "brightness") p.brightness = value;
+    else if (key == "contrast") p.contrast = value;
+    else if (key == "l") p.l = value;
+    else if (key == "a") p.a = value;
+    else if (key == "b") p.b = value;
+    else if (key == "h" || key == "hue") p.hue = value;
+    else if (key == "s" || key == "saturation") p.saturation = value;
+    else if (key == "i" || key == "ilumination") p.ilumination = value;
+    else if (key == "cR") p.cR = value;
+    else if (key == "cG") p.cG = value;
+    else if (key == "cB") p.cB = value;
+    else if (key == "ga") p.ga = value;
+    else if (key == "region") p.region = CLIP_RANGE(value, REGION_ALL, REGION_OUTSIDE);
+    else if (key == "feather") p.feather = std::max(0, value);
+    else return false;
+    return true;
+}
 
-    createTrackbar("cR", window_name, &cR, 2*cR, callbackAdjust);
-    createTrackbar("cG", window_name, &cG, 2*cG, callbackAdjust);
-    createTrackbar("cB", window_name, &cB, 2*cB, callbackAdjust);
+// Preset file: one "name = value" per line, '#' starts a comment. Nothing
+// is printed, on failure error says why, as --serve - replies on stdout
+static bool loadPreset(const string& filename, AdjustParams& p, string& error)
+{
+    ifstream in(filename.c_str());
+    if (!in)
+    {
+        error = "cannot open";
+        return false;
+    }
 
-    createTrackbar("ga", window_name, &ga, 50, callbackAdjust);
+    string line;
+    while (getline(in, line))
+    {
+        line = line.substr(0, line.find('#'));
+        size_t eq = line.find('=');
+        if (eq == string::npos)
+            continue;
 
-    callbackAdjust(0, 0);  
-    imshow(window_src, src);
-  
-    waitKey();  
+        string key;
+        int value;
+        stringstream ssKey(line.substr(0, eq));
+        stringstream ssValue(line.substr(eq + 1));
+        if (!(ssKey >> key) || !(ssValue >> value) || !setParam(p, key, value))
+        {
+            error = "bad line: " + line;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Write p in the format loadPreset reads
+static bool savePreset(const string& filename, const AdjustParams& p)
+{
+    ofstream out(filename.c_str());
+    if (!out)
+        return false;
+
+    out << "brightness = " << p.brightness << endl
+        << "contrast = " << p.contrast << endl
+        << "l = " << p.l << endl
+        << "a = " << p.a << endl
+        << "b = " << p.b << endl
+        << "h = " << p.hue << endl
+        << "s = " << p.saturation << endl
+        << "i = " << p.ilumination << endl
+        << "cR = " << p.cR << endl
+        << "cG = " << p.cG << endl
+        << "cB = " << p.cB << endl
+        << "ga = " << p.ga << endl
+        << "region = " << p.region << endl
+        << "feather = " << p.feather << endl;
+    return (bool)out;
+}
+
+// lower case extension of a file name with the dot, empty if it has none
+static string fileExtension(const string& filename)
+{
+    size_t dot = filename.find_last_of('.');
+    if (dot == string::npos)
+        return "";
+
+    string ext = filename.substr(dot);
+    for (size_t i = 0; i < ext.size(); i++)
+        ext[i] = (char)tolower(ext[i]);
+    return ext;
+}
+
+// .bgr files are MappedFrame containers
+static bool isRawFile(const string& filename)
+{
+    return fileExtension(filename) == ".bgr";
+}
+
+static bool isImageFile(const string& filename)
+{
+    static const char* exts[] = { ".jpg", ".jpeg", ".png", ".bmp", ".tif", ".tiff", ".webp", ".ppm", ".bgr" };
+
+    string ext = fileExtension(filename);
+    for (size_t i = 0; i < sizeof(exts) / sizeof(exts[0]); i++)
+    {
+        if (ext == exts[i])
+            return true;
+    }
+    return false;
+}
+
+static string baseName(const string& path)
+{
+    size_t slash = path.find_last_of("/\\");
+    return slash == string::npos ? path : path.substr(slash + 1);
+}
+
+static string dirName(const string& path)
+{
+    size_t slash = path.find_last_of("/\\");
+    if (slash == string::npos)
+        return ".";
+    return slash == 0 ? "/" : path.substr(0, slash);
+}
+
+// true if both paths exist and name the same file or directory
+static bool sameFile(const string& a, const string& b)
+{
+    struct stat sa, sb;
+    return ::stat(a.c_str(), &sa) == 0 && ::stat(b.c_str(), &sb) == 0 &&
+           sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+// Images to process: every image in a directory, or one path per line of
+// a manifest file
+static bool listInputs(const string& dir, const string& manifest, vector<string>& files)
+{
+    if (!dir.empty())
+    {
+        vector<String> found;
+        glob(dir, found, false);
+        for (size_t i = 0; i < found.size(); i++)
+        {
+            if (isImageFile(found[i]))
+                files.push_back(found[i]);
+        }
+        return true;
+    }
+
+    ifstream in(manifest.c_str());
+    if (!in)
+        return false;
+
+    string line;
+    while (getline(in, line))
+    {
+        size_t end = line.find_last_not_of(" \t\r");
+        if (end != string::npos)
+            files.push_back(line.substr(0, end + 1));
+    }
+    return true;
+}
+
+struct BatchResult
+{
+    bool ok;
+    AdjustStats stats;
+};
+
+/**
+ * Bounded blocking queue between two pipeline stages
+ *
+ * push() waits while the queue is full, so a slow stage holds back the
+ * stages feeding it instead of letting decoded frames pile up. Items cost
+ * a whole image of work each, so a mutex is not a measurable overhead.
+ */
+template<typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity)
+        : capacity(capacity), closed(false), maxSize(0), sizeSum(0), pushes(0)
+    {}
+
+    // false if the queue was closed
+    bool push(const T& item)
+    {
+        unique_lock<mutex> lock(m);
+        notFull.wait(lock, [this]() { return items.size() < capacity || closed; });
+        if (closed)
+            return false;
+
+        items.push_back(item);
+        maxSize = std::max(maxSize, items.size());
+        sizeSum += items.size();
+        pushes++;
+        notEmpty.notify_one();
+        return true;
+    }
+
+    // false once the queue is closed and empty
+    bool pop(T& item)
+    {
+        unique_lock<mutex> lock(m);
+        notEmpty.wait(lock, [this]() { return !items.empty() || closed; });
+        if (items.empty())
+            return false;
+
+        item = items.front();
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        lock_guard<mutex> lock(m);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+
+    void report(const string& name) const
+    {
+        lock_guard<mutex> lock(m);
+        cout << "queue " << name << ": max " << maxSize << "/" << capacity
+             << ", mean " << (pushes ? (double)sizeSum / pushes : 0.0) << endl;
+    }
+
+private:
+    size_t capacity;
+    bool closed;
+    deque<T> items;
+    size_t maxSize, sizeSum, pushes;
+    mutable mutex m;
+    condition_variable notEmpty, notFull;
+};
+
+// Busy time and item count of one pipeline stage
+struct StageCounter
+{
+    atomic<long long> items;
+    atomic<long long> ticks;
+
+    StageCounter() : items(0), ticks(0) {}
+
+    void add(int64 start)
+    {
+        items++;
+        ticks += getTickCount() - start;
+    }
+
+    void report(const string& name, int threads, double wallSec) const
+    {
+        double busy = ticks / getTickFrequency();
+        cout << name << ": " << items << " images, " << threads << " threads, "
+             << items / std::max(wallSec, 1e-9) << " img/s, "
+             << 100.0 * busy / std::max(wallSec * threads, 1e-9) << "% busy" << endl;
+    }
+};
+
+/**
+ * Raw frame container, memory-mapped
+ *
+ * A .bgr file is a 64-byte header followed by the packed rows of one
+ * CV_8UC3, CV_16UC3 or CV_32FC3 image, so it maps straight into a Mat
+ * header with no decoding. Processes reading the same file share its
+ * pages in the page cache.
+ *
+ * Header, native byte order: "IMGADJRW", uint32 version (1), int32 rows,
+ * cols and type, uint64 offset of the pixels (64), zero padding.
+ *
+ * create() writes a temporary file next to the target, with its space
+ * reserved up front so a full disk is an error, not a SIGBUS; commit()
+ * renames it over the target. A process that has the old file mapped
+ * keeps its pages, and readers never see a half-written frame.
+ */
+class MappedFrame
+{
+public:
+    MappedFrame() : base(0), length(0) {}
+    ~MappedFrame() { close(); }
+
+    // map an existing file; writes through mat go to private copies of the
+    // pages, the file is not changed
+    bool open(const string& filename);
+
+    // create a temporary file for a rows x cols image of type and map it
+    // shared, writes through mat go to the file
+    bool create(const string& filename, int rows, int cols, int type);
+
+    // replace the file given to create() with the written frame and close
+    bool commit();
+
+    // unmap; a created frame that was not committed is deleted
+    void close();
+
+    Mat mat;
+
+private:
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        int32_t rows, cols, type;
+        uint64_t offset;
+    };
+
+    bool map(int fd, bool shared);
+
+    void* base;
+    size_t length;
+    string target, temp;   // create(): the file to replace and its stand-in
+
+    MappedFrame(const MappedFrame&);
+    MappedFrame& operator=(const MappedFrame&);
+};
+
+static const char rawMagic[8] = { 'I', 'M', 'G', 'A', 'D', 'J', 'R', 'W' };
+static const size_t rawHeaderSize = 64;
+
+bool MappedFrame::map(int fd, bool shared)
+{
+    base = mmap(0, length, PROT_READ | PROT_WRITE, shared ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED)
+    {
+        base = 0;
+        return false;
+    }
+    return true;
+}
+
+bool MappedFrame::open(const string& filename)
+{
+    close();
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < rawHeaderSize)
+    {
+        ::close(fd);
+        return false;
+    }
+    length = (size_t)st.st_size;
+    if (!map(fd, false))
+        return false;
+
+    // the offset and sizes come from the file; rows * cols fits in 62
+    // bits, and comparing it with the pixels that fit after the offset
+    // cannot wrap around
+    const Header* h = (const Header*)base;
+    int type = h->type;
+    if (memcmp(h->magic, rawMagic, 8) != 0 || h->version != 1 || h->rows <= 0 || h->cols <= 0 ||
+        (type != CV_8UC3 && type != CV_16UC3 && type != CV_32FC3) ||
+        h->offset < rawHeaderSize || h->offset > length ||
+        (uint64_t)h->rows * h->cols > (length - h->offset) / CV_ELEM_SIZE(type))
+    {
+        close();
+        return false;
+    }
+    mat = Mat(h->rows, h->cols, type, (uchar*)base + h->offset);
+    return true;
+}
+
+bool MappedFrame::create(const string& filename, int rows, int cols, int type)
+{
+    close();
+    // same directory, so rename() is atomic
+    string path = filename + ".XXXXXX";
+    vector<char> name(path.begin(), path.end());
+    name.push_back('\0');
+    int fd = mkstemp(&name[0]);
+    if (fd < 0)
+        return false;
+    temp = &name[0];
+
+    length = rawHeaderSize + (size_t)rows * cols * CV_ELEM_SIZE(type);
+    if (fchmod(fd, 0644) != 0 || posix_fallocate(fd, 0, (off_t)length) != 0)
+    {
+        ::close(fd);
+        close();
+        return false;
+    }
+    if (!map(fd, true))
+    {
+        close();
+        return false;
+    }
+    target = filename;
+
+    Header* h = (Header*)base;
+    memcpy(h->magic, rawMagic, 8);
+    h->version = 1;
+    h->rows = rows;
+    h->cols = cols;
+    h->type = type;
+    h->offset = rawHeaderSize;
+    mat = Mat(rows, cols, type, (uchar*)base + rawHeaderSize);
+    return true;
+}
+
+bool MappedFrame::commit()
+{
+    bool ok = !temp.empty() && rename(temp.c_str(), target.c_str()) == 0;
+    if (ok)
+        temp.clear();
+    close();
+    return ok;
+}
+
+void MappedFrame::close()
+{
+    mat.release();
+    if (base)
+        munmap(base, length);
+    base = 0;
+    length = 0;
+
+    if (!temp.empty())
+        unlink(temp.c_str());
+    temp.clear();
+    target.clear();
+}
+
+// Raw container output, the pixels are copied once and never encoded
+static bool writeRaw(const string& filename, const Mat& img)
+{
+    MappedFrame frame;
+    if (!frame.create(filename, img.rows, img.cols, img.type()))
+        return false;
+    img.copyTo(frame.mat);
+    return frame.commit();
+}
+
+// path with its extension replaced by ext
+static string replaceExtension(const string& path, const string& ext)
+{
+    size_t dot = path.find_last_of('.');
+    size_t slash = path.find_last_of("/\\");
+    if (dot == string::npos || (slash != string::npos && dot < slash))
+        return path + ext;
+    return path.substr(0, dot) + ext;
+}
+
+// where runBatch writes the result for input; .bgr inputs without rawOut
+// are encoded as TIFF, which keeps 16-bit and float images
+static string batchOutput(const string& outDir, const string& input, bool rawOut)
+{
+    string output = outDir + "/" + baseName(input);
+    if (rawOut)
+        return replaceExtension(output, ".bgr");
+    return isRawFile(input) ? replaceExtension(output, ".tif") : output;
+}
+
+// img itself when it is 8-bit, else img scaled to 8 bits in buf, for the
+// mask and statistics, which are defined on 8-bit values. Float images are
+// taken to be in [0, 1] as ToneCurve takes them.
+static Mat& to8Bit(Mat& img, Mat& buf)
+{
+    if (img.depth() == CV_8U)
+        return img;
+    img.convertTo(buf, CV_8U, 255.0 / (img.depth() == CV_16U ? 65535.0 : 1.0));
+    return buf;
+}
+
+// The chain clips float images to [0, 1]; say so for HDR inputs, which
+// have to be normalised before they are adjusted
+static void warnHdr(const Mat& img, const string& name)
+{
+    if (img.depth() != CV_32F && img.depth() != CV_64F)
+        return;
+
+    double maxVal = 0;
+    minMaxLoc(img.reshape(1), 0, &maxVal);
+    if (maxVal > 1.0)
+    {
+        stringstream ss;
+        ss << "warning " << name << " has values up to " << maxVal << ", values above 1 are clipped" << endl;
+        cout << ss.str();
+    }
+}
+
+// One line for a job that threw, printed whole so threads do not
+// interleave; cv::Exception messages span several lines
+static void reportError(const string& file, const std::exception& e)
+{
+    string what = e.what();
+    std::replace(what.begin(), what.end(), '\n', ' ');
+    stringstream ss;
+    ss << "error " << file << " " << what << endl;
+    cout << ss.str();
+}
+
+struct BatchJob
+{
+    size_t index;
+    Mat img;   // decoded image, adjusted in place
+    shared_ptr<MappedFrame> frame;   // mapping behind img for .bgr inputs
+};
+
+/**
+ * Apply one preset to many images
+ *
+ * Decoder, adjustment and encoder threads are connected by bounded queues.
+ * Images are adjusted in place, so each image in flight costs one frame
+ * plus its mask, and peak memory depends on the queue sizes and thread
+ * counts only, not on how many files there are.
+ *
+ * .bgr inputs are mapped instead of decoded, and with rawOut the results
+ * are written as .bgr files instead of being encoded, so chained runs skip
+ * the codecs entirely.
+ *
+ * A non-empty cube replaces the chain for 8-bit images. With cubeOnly it
+ * was loaded from a file and there is no chain to fall back on, so 16-bit
+ * and float images fail.
+ *
+ * An exception in one job fails that image only.
+ *
+ * @return number of images that failed
+ */
+static int runBatch(const vector<string>& files, const string& outDir,
+                    const AdjustParams& params, const string& csvFile,
+                    int decoders, int adjusters, int encoders, int queueSize,
+                    bool rawOut, const ColorCube& cube, bool cubeOnly)
+{
+    AdjustGraph graph(params);
+    vector<BatchResult> results(files.size());
+    for (size_t i = 0; i < results.size(); i++)
+        results[i].ok = false;
+
+    BoundedQueue<BatchJob> decoded(queueSize);
+    BoundedQueue<BatchJob> adjusted(queueSize);
+
+    StageCounter decodeCount, adjustCount, encodeCount;
+    atomic<size_t> next(0);
+    atomic<int> decodersLeft(decoders), adjustersLeft(adjusters);
+    atomic<long long> poolHits(0), poolMisses(0);
+
+    // the pool already keeps every core busy
+    setNumThreads(1);
+    int64 start = getTickCount();
+
+    vector<thread> threads;
+    for (int t = 0; t < decoders; t++)
+    {
+        threads.push_back(thread([&]() {
+            for (size_t i = next++; i < files.size(); i = next++)
+            {
+                int64 t0 = getTickCount();
+                BatchJob job;
+                job.index = i;
+                try
+                {
+                    if (isRawFile(files[i]))
+                    {
+                        // copy on write, the input file is never changed
+                        job.frame = make_shared<MappedFrame>();
+                        if (job.frame->open(files[i]))
+                            job.img = job.frame->mat;
+                    }
+                    else
+                    {
+                        // 16-bit and float files keep their depth
+                        job.img = imread(files[i], IMREAD_ANYDEPTH | IMREAD_COLOR);
+                        warnHdr(job.img, files[i]);
+                    }
+                }
+                catch (const std::exception& e)
+                {
+                    reportError(files[i], e);
+                    job.img.release();
+                }
+                decodeCount.add(t0);
+                if ( job.img.data )
+                    decoded.push(job);
+            }
+            if (--decodersLeft == 0)
+                decoded.close();
+        }));
+    }
+    for (int t = 0; t < adjusters; t++)
+    {
+        threads.push_back(thread([&]() {
+            BatchJob job;
+            while (decoded.pop(job))
+            {
+                int64 t0 = getTickCount();
+                try
+                {
+                    // mask and weights come from the pool, images of one
+                    // size reuse the same buffers; the mask is taken before
+                    // the image is overwritten
+                    PooledMat mask(scratchPool(), job.img.rows, job.img.cols, CV_8UC1);
+                    PooledMat view(scratchPool());
+                    if (job.img.depth() != CV_8U)
+                        view.acquire(job.img.rows, job.img.cols, CV_8UC3);
+                    getMask(to8Bit(job.img, view.mat), mask.mat);
+
+                    // the cube takes 8-bit images only; deep ones run the
+                    // exact chain, unless the cube was loaded and there is
+                    // no chain
+                    bool useCube = !cube.empty() && job.img.depth() == CV_8U;
+                    if (cubeOnly && !useCube)
+                    {
+                        adjustCount.add(t0);
+                        continue;
+                    }
+
+                    if (params.region == REGION_ALL)
+                    {
+                        if (useCube)
+                            cube.apply(job.img, job.img);
+                        else
+                            graph.run(job.img);
+                    }
+                    else
+                    {
+                        PooledMat weight(scratchPool(), job.img.rows, job.img.cols, CV_8UC1);
+                        regionWeight(mask.mat, params.region, params.feather, weight.mat);
+                        if (useCube)
+                        {
+                            PooledMat graded(scratchPool(), job.img.rows, job.img.cols, CV_8UC3);
+                            cube.apply(job.img, graded.mat);
+                            blendRegion(job.img, graded.mat, weight.mat, job.img);
+                        }
+                        else
+                            graph.runMasked(job.img, job.img, weight.mat);
+                    }
+
+                    results[job.index].stats = getStats(to8Bit(job.img, view.mat), mask.mat);
+                }
+                catch (const std::exception& e)
+                {
+                    reportError(files[job.index], e);
+                    adjustCount.add(t0);
+                    continue;
+                }
+
+                adjustCount.add(t0);
+                adjusted.push(job);
+            }
+            // kernels run on this thread, so its pool saw all their buffers
+            poolHits += scratchPool().hits();
+            poolMisses += scratchPool().misses();
+            if (--adjustersLeft == 0)
+                adjusted.close();
+        }));
+    }
+    for (int t = 0; t < encoders; t++)
+    {
+        threads.push_back(thread([&]() {
+            BatchJob job;
+            while (adjusted.pop(job))
+            {
+                int64 t0 = getTickCount();
+                string output = batchOutput(outDir, files[job.index], rawOut);
+                try
+                {
+                    if (rawOut)
+                        results[job.index].ok = writeRaw(output, job.img);
+                    else
+                        results[job.index].ok = imwrite(output, job.img);
+                }
+                catch (const std::exception& e)
+                {
+                    reportError(files[job.index], e);
+                }
+                job.img.release();
+                job.frame.reset();
+                encodeCount.add(t0);
+            }
+        }));
+    }
+    for (size_t t = 0; t < threads.size(); t++)
+        threads[t].join();
+
+    double wallSec = (getTickCount() - start) / getTickFrequency();
+    decodeCount.report("decode", decoders, wallSec);
+    adjustCount.report("adjust", adjusters, wallSec);
+    encodeCount.report("encode", encoders, wallSec);
+    decoded.report("decoded");
+    adjusted.report("adjusted");
+    cout << "pool scratch: " << poolHits << " hits, " << poolMisses << " misses" << endl;
+
+    int failed = 0;
+    ofstream csv;
+    if (!csvFile.empty())
+    {
+        csv.open(csvFile.c_str());
+        csv << "file,R,G,B,Lab_L,Lab_a,Lab_b,H,S,V" << endl;
+    }
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        if (!results[i].ok)
+        {
+            cout << "error process " << files[i] << endl;
+            failed++;
+            continue;
+        }
+        if (csv.is_open())
+        {
+            const AdjustStats& s = results[i].stats;
+            csv << files[i];
+            for (int k = 0; k < 3; k++)
+                csv << "," << s.rgb[k];
+            for (int k = 0; k < 3; k++)
+                csv << "," << s.lab[k];
+            for (int k = 0; k < 3; k++)
+                csv << "," << s.hsv[k];
+            csv << endl;
+        }
+    }
+
+    cout << files.size() - failed << " of " << files.size() << " images done in "
+         << wallSec << " s" << endl;
+    return failed;
+}
+
+// Header of a binary PPM (P6) file, 8-bit or 16-bit samples
+struct PpmHeader
+{
+    int width, height, maxval;
+};
+
+// Next number of a PPM header, skipping whitespace and '#' comments
+static bool readPpmNumber(istream& in, int& value)
+{
+    char c;
+    while (in.get(c))
+    {
+        if (c == '#')
+        {
+            string comment;
+            getline(in, comment);
+        }
+        else if (!isspace((unsigned char)c))
+        {
+            in.unget();
+            return (bool)(in >> value);
+        }
+    }
+    return false;
+}
+
+static bool readPpmHeader(istream& in, PpmHeader& h)
+{
+    char magic[2];
+    if (!in.read(magic, 2) || magic[0] != 'P' || magic[1] != '6')
+        return false;
+    if (!readPpmNumber(in, h.width) || !readPpmNumber(in, h.height) || !readPpmNumber(in, h.maxval))
+        return false;
+
+    // one whitespace byte separates the header from the pixels
+    in.get();
+    return h.width > 0 && h.height > 0 && (h.maxval == 255 || h.maxval == 65535);
+}
+
+// Fill a CV_8UC3 or CV_16UC3 block with the next rows of a PPM, as BGR
+static bool readPpmRows(istream& in, Mat& rows)
+{
+    for (int i = 0; i < rows.rows; i++)
+    {
+        uchar* p = rows.ptr<uchar>(i);
+        if (!in.read((char*)p, rows.cols * rows.elemSize()))
+            return false;
+
+        // 16-bit samples are big-endian
+        if (rows.depth() == CV_16U)
+        {
+            ushort* q = rows.ptr<ushort>(i);
+            for (int j = 0; j < rows.cols*3; j++)
+                q[j] = (ushort)((p[j*2] << 8) | p[j*2+1]);
+        }
+    }
+    cvtColor(rows, rows, CV_RGB2BGR);
+    return true;
+}
+
+// Append BGR rows to a PPM, rows are converted in place
+static bool writePpmRows(ostream& out, Mat& rows)
+{
+    cvtColor(rows, rows, CV_BGR2RGB);
+    for (int i = 0; i < rows.rows; i++)
+    {
+        uchar* p = rows.ptr<uchar>(i);
+        if (rows.depth() == CV_16U)
+        {
+            const ushort* q = rows.ptr<ushort>(i);
+            for (int j = 0; j < rows.cols*3; j++)
+            {
+                ushort v = q[j];
+                p[j*2] = (uchar)(v >> 8);
+                p[j*2+1] = (uchar)(v & 255);
+            }
+        }
+        if (!out.write((const char*)p, rows.cols * rows.elemSize()))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Adjust an image of any size strip by strip
+ *
+ * The input is read `strip` rows at a time, run through the chain and
+ * written out before the next rows are read, and the statistics are summed
+ * strip by strip, so memory use depends on the width and strip height,
+ * not on the image height. With a feathered region, `feather` rows of
+ * context are kept above and below the strip, so the blend weights are the
+ * same as for the whole image. Input and output are binary PPM files.
+ *
+ * @return 0 if success
+ */
+static int streamImage(const string& input, const string& output,
+                       const AdjustParams& params, int strip)
+{
+    ifstream in(input.c_str(), ios::binary);
+    PpmHeader h;
+    if (!in || !readPpmHeader(in, h))
+    {
+        cout << "error read " << input << endl;
+        return -1;
+    }
+    ofstream out(output.c_str(), ios::binary);
+    if (!out)
+    {
+        cout << "error write " << output << endl;
+        return -1;
+    }
+    out << "P6\n" << h.width << " " << h.height << "\n" << h.maxval << "\n";
+
+    AdjustGraph graph(params);
+    int halo = params.region != REGION_ALL ? params.feather : 0;
+    strip = std::max(1, strip);
+
+    // image rows [top, top + have) and the getMask of each, the mask is
+    // taken when a row is read because its pixels are adjusted in place
+    Mat window(strip + 2*halo, h.width, h.maxval == 255 ? CV_8UC3 : CV_16UC3);
+    Mat maskWindow(strip + 2*halo, h.width, CV_8UC1);
+    Mat view, weight;
+    int top = 0, have = 0;
+    long long total[STATS_SUMS] = { 0 };
+    int64 start = getTickCount();
+
+    for (int y0 = 0; y0 < h.height; y0 += strip)
+    {
+        int y1 = std::min(y0 + strip, h.height);
+
+        // move the context rows of this strip to the top of the window
+        int drop = std::max(0, y0 - halo) - top;
+        for (int i = drop; i < have; i++)
+        {
+            Mat row = window.row(i - drop);
+            Mat maskRow = maskWindow.row(i - drop);
+            window.row(i).copyTo(row);
+            maskWindow.row(i).copyTo(maskRow);
+        }
+        top += drop;
+        have -= drop;
+
+        int need = std::min(y1 + halo, h.height) - top;
+        if (need > have)
+        {
+            Mat fresh = window.rowRange(have, need);
+            Mat freshMask = maskWindow.rowRange(have, need);
+            if (!readPpmRows(in, fresh))
+            {
+                cout << "error read " << input << endl;
+                return -1;
+            }
+            getMask(to8Bit(fresh, view), freshMask);
+            have = need;
+        }
+
+        Mat rows = window.rowRange(y0 - top, y1 - top);
+        Mat mask = maskWindow.rowRange(y0 - top, y1 - top);
+        if (params.region == REGION_ALL)
+            graph.run(rows);
+        else
+        {
+            regionWeight(maskWindow.rowRange(0, have), params.region, params.feather, weight);
+            graph.runMasked(rows, rows, weight.rowRange(y0 - top, y1 - top));
+        }
+        addStats(to8Bit(rows, view), mask, 1, total);
+
+        if (!writePpmRows(out, rows))
+        {
+            cout << "error write " << output << endl;
+            return -1;
+        }
+    }
+
+    AdjustStats stats = statsFromSums(total, 1);
+    cout << "rst:" << stats.rgb[0] << "," << stats.rgb[1] << "," << stats.rgb[2] << ","
+         << stats.lab[0] << "," << stats.lab[1] << "," << stats.lab[2] << ","
+         << stats.hsv[0] << "," << stats.hsv[1] << "," << stats.hsv[2] << endl;
+    cout << h.width << "x" << h.height << " in strips of " << strip << " rows done in "
+         << (getTickCount() - start) / getTickFrequency() << " s" << endl;
+    return 0;
+}
+
+// ema += weight * (s - ema) for every mean and bound of the statistics
+static void smoothStats(AdjustStats& ema, const AdjustStats& s, float weight)
+{
+    for (int c = 0; c < 3; c++)
+    {
+        ema.rgb[c] += weight * (s.rgb[c] - ema.rgb[c]);
+        ema.lab[c] += weight * (s.lab[c] - ema.lab[c]);
+        ema.hsv[c] += weight * (s.hsv[c] - ema.hsv[c]);
+        ema.rgbErr[c] += weight * (s.rgbErr[c] - ema.rgbErr[c]);
+        ema.labErr[c] += weight * (s.labErr[c] - ema.labErr[c]);
+        ema.hsvErr[c] += weight * (s.hsvErr[c] - ema.hsvErr[c]);
+    }
+    ema.count = s.count;
+}
+
+/**
+ * Grade a video or numbered frame sequence
+ *
+ * One thread decodes, one encodes and the calling thread adjusts, with a
+ * queue of two frames between each, so frame N+1 is decoded and frame N-1
+ * written while frame N is adjusted; the kernels still spread each frame
+ * over all threads. Frame buffers circulate between the stages instead of
+ * being allocated per frame.
+ *
+ * The getMask region moves slowly between frames, so for statistics it is
+ * rebuilt only every maskEvery frames; with a region set it drives the
+ * adjustment and is rebuilt every frame. Statistics are sampled per frame
+ * and smoothed with an exponential moving average, emaWeight is the share
+ * of the newest frame.
+ *
+ * input and output are anything VideoCapture and VideoWriter take, such
+ * as clip.mp4 or frames/%05d.png.
+ *
+ * @return 0 if success
+ */
+static int runVideo(const string& input, const string& output, const string& fourcc,
+                    const AdjustParams& params, const string& csvFile,
+                    int maskEvery, float emaWeight)
+{
+    VideoCapture cap(input);
+    if (!cap.isOpened())
+    {
+        cout << "error read video " << input << endl;
+        return -1;
+    }
+    double fps = cap.get(CAP_PROP_FPS);
+    if (fps <= 0)
+        fps = 30;
+    maskEvery = std::max(1, maskEvery);
+    emaWeight = CLIP_RANGE(emaWeight, 0.f, 1.f);
+
+    ofstream csv;
+    if (!csvFile.empty())
+    {
+        csv.open(csvFile.c_str());
+        csv << "frame,R,G,B,Lab_L,Lab_a,Lab_b,H,S,V,"
+               "R_err,G_err,B_err,Lab_L_err,Lab_a_err,Lab_b_err,H_err,S_err,V_err" << endl;
+    }
+
+    AdjustGraph graph(params);
+    BoundedQueue<Mat> decoded(2), adjusted(2);
+    // two queued per queue and one held by each stage
+    BoundedQueue<Mat> spare(7);
+    for (int i = 0; i < 7; i++)
+        spare.push(Mat());
+
+    StageCounter decodeCount, adjustCount, encodeCount;
+    bool writeOk = true;
+    int64 start = getTickCount();
+
+    thread decoder([&]() {
+        Mat frame;
+        while (spare.pop(frame))
+        {
+            int64 t0 = getTickCount();
+            if (!cap.read(frame) || frame.empty())
+                break;
+            decodeCount.add(t0);
+            if (!decoded.push(frame))
+                break;
+        }
+        decoded.close();
+    });
+
+    thread encoder([&]() {
+        VideoWriter writer;
+        Mat frame;
+        while (adjusted.pop(frame))
+        {
+            int64 t0 = getTickCount();
+            if (!writer.isOpened())
+            {
+                // image sequences take no codec
+                int code = output.find('%') != string::npos || fourcc.size() != 4 ? 0 :
+                           VideoWriter::fourcc(fourcc[0], fourcc[1], fourcc[2], fourcc[3]);
+                if (!writer.open(output, code, fps, frame.size()))
+                {
+                    writeOk = false;
+                    break;
+                }
+            }
+            writer.write(frame);
+            encodeCount.add(t0);
+            spare.push(frame);
+        }
+        adjusted.close();
+        spare.close();
+    });
+
+    Mat frame, mask, weight;
+    AdjustStats ema = AdjustStats();
+    long long n = 0;
+    while (decoded.pop(frame))
+    {
+        int64 t0 = getTickCount();
+        // a region adjustment needs the mask of this frame, a stale one
+        // would grade pixels outside the region; statistics alone can use
+        // one that is a few frames old
+        if (params.region != REGION_ALL || n % maskEvery == 0 || mask.size() != frame.size())
+            getMask(frame, mask);
+        if (params.region != REGION_ALL)
+            regionWeight(mask, params.region, params.feather, weight);
+
+        if (params.region == REGION_ALL)
+            graph.run(frame);
+        else
+            graph.runMasked(frame, frame, weight);
+
+        AdjustStats s = getStats(frame, mask, statsStep(frame));
+        if (n == 0)
+            ema = s;
+        else
+            smoothStats(ema, s, emaWeight);
+
+        if (csv.is_open())
+        {
+            csv << n;
+            for (int k = 0; k < 3; k++)
+                csv << "," << ema.rgb[k];
+            for (int k = 0; k < 3; k++)
+                csv << "," << ema.lab[k];
+            for (int k = 0; k < 3; k++)
+                csv << "," << ema.hsv[k];
+            for (int k = 0; k < 3; k++)
+                csv << "," << ema.rgbErr[k];
+            for (int k = 0; k < 3; k++)
+                csv << "," << ema.labErr[k];
+            for (int k = 0; k < 3; k++)
+                csv << "," << ema.hsvErr[k];
+            csv << endl;
+        }
+        n++;
+        adjustCount.add(t0);
+        if (!adjusted.push(frame))
+            break;
+    }
+    decoded.close();
+    adjusted.close();
+    decoder.join();
+    encoder.join();
+
+    if (!writeOk)
+    {
+        cout << "error write video " << output << endl;
+        return -1;
+    }
+
+    double wallSec = (getTickCount() - start) / getTickFrequency();
+    decodeCount.report("decode", 1, wallSec);
+    adjustCount.report("adjust", 1, wallSec);
+    encodeCount.report("encode", 1, wallSec);
+    cout << "rst:" << ema.rgb[0] << "," << ema.rgb[1] << "," << ema.rgb[2] << ","
+         << ema.lab[0] << "," << ema.lab[1] << "," << ema.lab[2] << ","
+         << ema.hsv[0] << "," << ema.hsv[1] << "," << ema.hsv[2] << " +-" << maxErr(ema) << endl;
+    cout << n << " frames done in " << wallSec << " s, " << n / std::max(wallSec, 1e-9) << " fps" << endl;
+    return 0;
+}
+
+//===== adjustment service ====
+
+// The parameters as one list of ints, for hashing and comparing presets
+static void paramsFields(const AdjustParams& p, int* v)
+{
+    int fields[14] = { p.brightness, p.contrast, p.l, p.a, p.b,
+                       p.hue, p.saturation, p.ilumination,
+                       p.cR, p.cG, p.cB, p.ga, p.region, p.feather };
+    memcpy(v, fields, sizeof(fields));
+}
+
+// FNV-1a hash of the parameters, jobs with equal keys share a preset
+static uint64_t paramsKey(const AdjustParams& p)
+{
+    int v[14];
+    paramsFields(p, v);
+    uint64_t h = 1469598103934665603ULL;
+    const uchar* bytes = (const uchar*)v;
+    for (size_t i = 0; i < sizeof(v); i++)
+    {
+        h ^= bytes[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static bool sameParams(const AdjustParams& p, const AdjustParams& q)
+{
+    int v[14], w[14];
+    paramsFields(p, v);
+    paramsFields(q, w);
+    return memcmp(v, w, sizeof(v)) == 0;
+}
+
+/**
+ * Compiled presets of the service, least recently used first out
+ *
+ * Building an AdjustGraph composes the lookup tables of the chain and
+ * baking a ColorCube runs the chain on a whole lattice, so both are kept
+ * per parameter set and reused by every later job with the same preset.
+ * Only the job thread of AdjustServer uses the cache, so it takes no lock.
+ */
+class PresetCache
+{
+public:
+    struct Entry
+    {
+        Entry(const AdjustParams& p, uint64_t key) : params(p), key(key), graph(p) {}
+
+        AdjustParams params;
+        uint64_t key;
+        AdjustGraph graph;
+        ColorCube cube;     // baked on first use by a job that asks for it
+    };
+
+    explicit PresetCache(size_t capacity)
+        : capacity(std::max<size_t>(capacity, 1)), hits(0), misses(0)
+    {}
+
+    // entry of p, compiled on a miss; key is paramsKey(p)
+    shared_ptr<Entry> get(const AdjustParams& p, uint64_t key);
+
+    string report() const;
+
+private:
+    size_t capacity;
+    list<shared_ptr<Entry> > entries;   // most recently used first
+    long long hits, misses;
+};
+
+shared_ptr<PresetCache::Entry> PresetCache::get(const AdjustParams& p, uint64_t key)
+{
+    for (list<shared_ptr<Entry> >::iterator it = entries.begin(); it != entries.end(); ++it)
+    {
+        if ((*it)->key == key && sameParams((*it)->params, p))
+        {
+            entries.splice(entries.begin(), entries, it);
+            hits++;
+            return entries.front();
+        }
+    }
+
+    misses++;
+    entries.push_front(make_shared<Entry>(p, key));
+    if (entries.size() > capacity)
+        entries.pop_back();
+    return entries.front();
+}
+
+string PresetCache::report() const
+{
+    stringstream ss;
+    ss << "cache " << entries.size() << "/" << capacity << " presets, "
+       << hits << " hits, " << misses << " misses";
+    return ss.str();
+}
+
+// Where the replies to one client go; jobs hold it until they have replied
+class ReplyChannel
+{
+public:
+    ReplyChannel(int fd, bool ownsFd) : fd(fd), ownsFd(ownsFd) {}
+    ~ReplyChannel() { if (ownsFd) ::close(fd); }
+
+    // one reply line, whole even when several threads reply at once
+    void send(const string& line)
+    {
+        lock_guard<mutex> lock(m);
+        string out = line + "\n";
+        for (size_t done = 0; done < out.size(); )
+        {
+            ssize_t n = ::write(fd, out.data() + done, out.size() - done);
+            if (n <= 0)
+                return;
+            done += n;
+        }
+    }
+
+private:
+    int fd;
+    bool ownsFd;
+    mutex m;
+
+    ReplyChannel(const ReplyChannel&);
+    ReplyChannel& operator=(const ReplyChannel&);
+};
+
+struct ServeJob
+{
+    string input, output;
+    AdjustParams params;
+    uint64_t key;
+    int cube;       // lattice size of a baked 3D LUT, 0 for the exact chain
+    shared_ptr<ReplyChannel> reply;
+};
+
+/**
+ * Long-running adjustment service
+ *
+ * Clients send one request per line and get one reply line per request:
+ *
+ *     adjust <input> <output> [preset=<file>] [cube=<n>] [name=value ...]
+ *         -> ok <output> R,G,B,Lab_L,Lab_a,Lab_b,H,S,V <ms>  |  error <input> <reason>
+ *     cache  -> the preset cache counters
+ *     quit   -> stops the service once the queued jobs are done
+ *
+ * name=value overrides the preset as the batch mode flags do. cube=<n>
+ * uses a baked n^3 ColorCube instead of the exact chain, for 8-bit jobs on
+ * the whole image. Requests come from stdin (replies on stdout) or from
+ * clients of a Unix socket, so the service is tested with a pipe or a local
+ * client such as `nc -U` and never listens on the network. The socket is
+ * only accessible to the user running the service, since every client can
+ * read and write any file the service can. Request lines are limited to
+ * maxLine bytes, and a job that fails or throws gets an error reply
+ * without taking the service down.
+ *
+ * One job thread runs the kernels, which spread each image over all
+ * threads. Jobs run in the order they were queued, so a job can read what
+ * the same client's earlier jobs wrote; consecutive jobs with one preset
+ * look it up once and share its baked cube. Replies carry the output path.
+ */
+class AdjustServer
+{
+public:
+    AdjustServer(size_t cacheSize, size_t queueSize)
+        : cache(cacheSize), jobs(std::max<size_t>(queueSize, 1)), listenFd(-1), stopping(false), readers(0)
+    {}
+
+    int serveStdio();
+    int serveSocket(const string& path);
+
+private:
+    static const size_t maxLine = 64 * 1024;
+
+    void readRequests(int fd, const shared_ptr<ReplyChannel>& channel);
+    bool handleLine(const string& line, const shared_ptr<ReplyChannel>& channel);
+    void runJobs();
+    void runJob(const ServeJob& job, PresetCache::Entry& preset);
+    void stop();
+
+    PresetCache cache;
+    BoundedQueue<ServeJob> jobs;
+    int listenFd;
+    atomic<bool> stopping;
+
+    // socket clients still being read
+    mutex clientsMutex;
+    condition_variable clientsDone;
+    vector<int> clientFds;
+    int readers;
+};
+
+// Read request lines from fd until the client closes it or stop() shuts
+// its read side. A line longer than maxLine gets an error reply and is
+// dropped without being buffered.
+void AdjustServer::readRequests(int fd, const shared_ptr<ReplyChannel>& channel)
+{
+    string pending;
+    bool overlong = false;   // dropping the rest of a line that was too long
+    char buf[4096];
+    for (;;)
+    {
+        ssize_t n = ::read(fd, buf, sizeof(buf));
+        if (n <= 0)
+            break;
+        pending.append(buf, n);
+
+        size_t eol;
+        while ((eol = pending.find('\n')) != string::npos)
+        {
+            string line = pending.substr(0, eol);
+            pending.erase(0, eol + 1);
+            if (overlong)
+            {
+                overlong = false;
+                continue;
+            }
+            if (!handleLine(line, channel))
+            {
+                stop();
+                return;
+            }
+        }
+
+        if (pending.size() > maxLine)
+        {
+            if (!overlong)
+            {
+                stringstream ss;
+                ss << "error request longer than " << maxLine << " bytes";
+                channel->send(ss.str());
+            }
+            overlong = true;
+            pending.clear();
+        }
+    }
+    if (!pending.empty() && !overlong)
+        handleLine(pending, channel);
+}
+
+// Queue or answer one request, false on quit
+bool AdjustServer::handleLine(const string& line, const shared_ptr<ReplyChannel>& channel)
+{
+    stringstream ss(line);
+    string command;
+    if (!(ss >> command))
+        return true;
+
+    if (command == "quit")
+        return false;
+    if (command == "cache")
+    {
+        channel->send(cache.report());
+        return true;
+    }
+
+    ServeJob job;
+    job.cube = 0;
+    job.reply = channel;
+    if (command != "adjust" || !(ss >> job.input >> job.output))
+    {
+        channel->send("error " + line + " bad request");
+        return true;
+    }
+
+    // the output is truncated before the input is read
+    if (sameFile(job.input, job.output))
+    {
+        channel->send("error " + job.input + " output is the input");
+        return true;
+    }
+
+    vector<pair<string, int> > overrides;
+    string preset, arg;
+    while (ss >> arg)
+    {
+        size_t eq = arg.find('=');
+        string key = arg.substr(0, eq);
+        string value = eq == string::npos ? "" : arg.substr(eq + 1);
+        int number = 0;
+        if (key == "preset")
+            preset = value;
+        else if (!parseInt(value, number))
+        {
+            channel->send("error " + job.input + " bad number " + arg);
+            return true;
+        }
+        else if (key == "cube")
+            job.cube = number;
+        else
+            overrides.push_back(make_pair(key, number));
+    }
+
+    string error;
+    if (!preset.empty() && !loadPreset(preset, job.params, error))
+    {
+        channel->send("error " + job.input + " bad preset " + preset + " " + error);
+        return true;
+    }
+    for (size_t i = 0; i < overrides.size(); i++)
+    {
+        if (!setParam(job.params, overrides[i].first, overrides[i].second))
+        {
+            channel->send("error " + job.input + " bad parameter " + overrides[i].first);
+            return true;
+        }
+    }
+    if (job.cube != 0 && (job.cube < 2 || job.cube > 256))
+    {
+        channel->send("error " + job.input + " bad cube size");
+        return true;
+    }
+
+    job.key = paramsKey(job.params);
+    if (!jobs.push(job))
+        channel->send("error " + job.input + " service stopping");
+    return true;
+}
+
+void AdjustServer::runJobs()
+{
+    // jobs are never reordered, a later job of a client may read the
+    // output of an earlier one; only a run of consecutive jobs with one
+    // preset skips the cache lookup
+    shared_ptr<PresetCache::Entry> preset;
+    ServeJob job;
+    while (jobs.pop(job))
+    {
+        // a bad input or a failed allocation fails its own job only
+        try
+        {
+            if (!preset || preset->key != job.key || !sameParams(preset->params, job.params))
+                preset = cache.get(job.params, job.key);
+            runJob(job, *preset);
+        }
+        catch (const std::exception& e)
+        {
+            // cv::Exception messages span several lines, replies do not
+            string what = e.what();
+            std::replace(what.begin(), what.end(), '\n', ' ');
+            job.reply->send("error " + job.input + " " + what);
+        }
+    }
+}
+
+void AdjustServer::runJob(const ServeJob& job, PresetCache::Entry& preset)
+{
+    int64 t0 = getTickCount();
+    const AdjustParams& params = preset.params;
+
+    Mat img;
+    MappedFrame frame;
+    if (isRawFile(job.input))
+    {
+        if (frame.open(job.input))
+            img = frame.mat;
+    }
+    else
+        img = imread(job.input, IMREAD_ANYDEPTH | IMREAD_COLOR);
+    if (!img.data)
+    {
+        job.reply->send("error " + job.input + " cannot read");
+        return;
+    }
+
+    // as in runBatch, the mask is taken before the image is overwritten
+    PooledMat mask(scratchPool(), img.rows, img.cols, CV_8UC1);
+    bool deep = img.depth() != CV_8U;
+    PooledMat view(scratchPool());
+    if (deep)
+        view.acquire(img.rows, img.cols, CV_8UC3);
+    getMask(to8Bit(img, view.mat), mask.mat);
+
+    if (job.cube > 0 && !deep && params.region == REGION_ALL)
+    {
+        if (preset.cube.size() != job.cube)
+            preset.cube.bake(preset.graph, job.cube);
+        preset.cube.apply(img, img);
+    }
+    else if (params.region == REGION_ALL)
+        preset.graph.run(img);
+    else
+    {
+        PooledMat weight(scratchPool(), img.rows, img.cols, CV_8UC1);
+        regionWeight(mask.mat, params.region, params.feather, weight.mat);
+        preset.graph.runMasked(img, img, weight.mat);
+    }
+
+    AdjustStats s = getStats(to8Bit(img, view.mat), mask.mat);
+    bool ok = isRawFile(job.output) ? writeRaw(job.output, img) : imwrite(job.output, img);
+    if (!ok)
+    {
+        job.reply->send("error " + job.input + " cannot write " + job.output);
+        return;
+    }
+
+    stringstream ss;
+    ss << "ok " << job.output << " "
+       << s.rgb[0] << "," << s.rgb[1] << "," << s.rgb[2] << ","
+       << s.lab[0] << "," << s.lab[1] << "," << s.lab[2] << ","
+       << s.hsv[0] << "," << s.hsv[1] << "," << s.hsv[2] << " "
+       << (getTickCount() - t0) * 1000.0 / getTickFrequency();
+    job.reply->send(ss.str());
+}
+
+// Stop taking requests; queued jobs still run and reply
+void AdjustServer::stop()
+{
+    if (stopping.exchange(true))
+        return;
+    jobs.close();
+
+    lock_guard<mutex> lock(clientsMutex);
+    if (listenFd >= 0)
+        ::shutdown(listenFd, SHUT_RDWR);
+    for (size_t i = 0; i < clientFds.size(); i++)
+        ::shutdown(clientFds[i], SHUT_RD);
+}
+
+int AdjustServer::serveStdio()
+{
+    thread worker([this]() { runJobs(); });
+    readRequests(0, make_shared<ReplyChannel>(1, false));
+    jobs.close();
+    worker.join();
+    return 0;
+}
+
+int AdjustServer::serveSocket(const string& path)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+    {
+        cout << "error socket path too long " << path << endl;
+        return -1;
+    }
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    // a stale socket of an earlier run is replaced, any other file is not
+    struct stat st;
+    if (::lstat(path.c_str(), &st) == 0)
+    {
+        if (!S_ISSOCK(st.st_mode))
+        {
+            cout << "error " << path << " exists and is not a socket" << endl;
+            return -1;
+        }
+        ::unlink(path.c_str());
+    }
+
+    // owner only, clients act with the service's file access; nothing else
+    // runs yet, so the process-wide umask is safe to change
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t oldMask = ::umask(077);
+    bool bound = fd >= 0 && ::bind(fd, (sockaddr*)&addr, sizeof(addr)) == 0;
+    ::umask(oldMask);
+    if (!bound || ::listen(fd, 16) != 0)
+    {
+        cout << "error listen " << path << endl;
+        if (fd >= 0)
+            ::close(fd);
+        return -1;
+    }
+    {
+        lock_guard<mutex> lock(clientsMutex);
+        listenFd = fd;
+    }
+    cout << "listening on " << path << endl;
+
+    thread worker([this]() { runJobs(); });
+    while (!stopping)
+    {
+        int client = ::accept(fd, 0, 0);
+        if (client < 0)
+        {
+            if (errno == EINTR && !stopping)
+                continue;
+            break;
+        }
+
+        lock_guard<mutex> lock(clientsMutex);
+        if (stopping)
+        {
+            ::close(client);
+            break;
+        }
+        clientFds.push_back(client);
+        readers++;
+        thread([this, client]() {
+            // the channel closes the socket once the last job replied
+            shared_ptr<ReplyChannel> channel(new ReplyChannel(client, true));
+            readRequests(client, channel);
+
+            lock_guard<mutex> lock(clientsMutex);
+            clientFds.erase(std::find(clientFds.begin(), clientFds.end(), client));
+            readers--;
+            clientsDone.notify_all();
+        }).detach();
+    }
+
+    stop();
+    {
+        unique_lock<mutex> lock(clientsMutex);
+        clientsDone.wait(lock, [this]() { return readers == 0; });
+        listenFd = -1;
+    }
+    worker.join();
+    ::close(fd);
+    ::unlink(path.c_str());
+    cout << cache.report() << endl;
+    return 0;
+}
+
+//===== benchmark ====
+
+// Comma-separated numbers, such as "1,12,24"; false if one is not a number
+static bool parseList(const string& s, vector<double>& values)
+{
+    stringstream ss(s);
+    string item;
+    while (getline(ss, item, ','))
+    {
+        double v;
+        if (item.empty())
+            continue;
+        if (!parseDouble(item, v))
+            return false;
+        values.push_back(v);
+    }
+    return true;
+}
+
+// Best time of `reps` runs of fn after one untimed warm-up, in ms
+template<typename Fn>
+static double bestTime(int reps, const Fn& fn)
+{
+    fn();
+    double best = 1e30;
+    for (int r = 0; r < reps; r++)
+    {
+        int64 t0 = getTickCount();
+        fn();
+        best = std::min(best, (getTickCount() - t0) * 1000.0 / getTickFrequency());
+    }
+    return best;
+}
+
+/**
+ * Kernel micro-benchmark
+ *
+ * Runs the golden checks with every thread count, then times each kernel
+ * on synthetic 8-bit and 16-bit images of each size (in megapixels) and
+ * thread count. Throughput is given in Mpix/s and in GB/s of pixels read
+ * plus written. jsonFile, if given, receives one record per measurement so
+ * runs can be compared across commits.
+ *
+ * @return 0 if every golden check passed
+ */
+static int runBench(const vector<double>& sizes, const vector<double>& threadCounts,
+                    int reps, const string& jsonFile)
+{
+    // timed with the typical preset
+    AdjustParams p = goldenParams()[0];
+
+    int failed = 0;
+    for (size_t t = 0; t < threadCounts.size(); t++)
+    {
+        setNumThreads((int)threadCounts[t]);
+        cout << "golden checks, " << (int)threadCounts[t] << " threads" << endl;
+        failed += runGoldenSets();
+    }
+
+    stringstream json;
+    AdjustGraph graph(p);
+    ColorCube cube;
+    cube.bake(graph, 33);
+    for (size_t si = 0; si < sizes.size(); si++)
+    {
+        // 4:3 frames
+        int cols = std::max(1, (int)sqrt(sizes[si] * 1e6 * 4 / 3));
+        int rows = std::max(1, (int)(sizes[si] * 1e6 / cols));
+
+        static const int depths[2] = { CV_8U, CV_16U };
+        for (int di = 0; di < 2; di++)
+        {
+            int depth = depths[di];
+            Mat img = syntheticImage(rows, cols, depth);
+            Mat out(img.size(), img.type()), mask;
+            double mp = img.total() / 1e6;
+            double bytes = (double)img.total() * img.elemSize();
+            const char* depthName = depth == CV_8U ? "8U" : "16U";
+
+            for (size_t t = 0; t < threadCounts.size(); t++)
+            {
+                int threads = (int)threadCounts[t];
+                setNumThreads(threads);
+
+                auto record = [&](const char* kernel, double moved, double ms) {
+                    double mpix = mp / (ms / 1000);
+                    double gb = moved / 1e9 / (ms / 1000);
+                    cout << kernel << " " << mp << " MP " << depthName << " " << threads
+                         << " threads: " << ms << " ms, " << mpix << " Mpix/s, " << gb << " GB/s" << endl;
+                    json << (json.tellp() > 0 ? ",\n" : "")
+                         << "  {\"kernel\": \"" << kernel << "\", \"mp\": " << mp
+                         << ", \"depth\": \"" << depthName << "\", \"threads\": " << threads
+                         << ", \"ms\": " << ms << ", \"mpix_s\": " << mpix << ", \"gb_s\": " << gb << "}";
+                };
+
+                record("brightnessContrast", 2 * bytes,
+                       bestTime(reps, [&]() { adjustBrightnessContrast(img, out, p.brightness, p.contrast); }));
+                record("AdjustLAB", 2 * bytes,
+                       bestTime(reps, [&]() { AdjustLAB(img, out, p.l, p.a, p.b); }));
+                record("AdjustHSI", 2 * bytes,
+                       bestTime(reps, [&]() { AdjustHSI(img, out, p.hue, p.saturation, p.ilumination); }));
+                record("ColorBalance", 2 * bytes,
+                       bestTime(reps, [&]() { ColorBalance(img, out, p.cB, p.cG, p.cR); }));
+                record("GammaCorrect", 2 * bytes,
+                       bestTime(reps, [&]() { GammaCorrect(img, out, p.ga); }));
+                record("chain", 2 * bytes,
+                       bestTime(reps, [&]() { graph.run(img, out); }));
+
+                // the mask and statistics only take 8-bit images, getStats
+                // uses the mask the getMask runs leave behind
+                if (depth != CV_8U)
+                    continue;
+                record("ColorCube 33", 2 * bytes,
+                       bestTime(reps, [&]() { cube.apply(img, out); }));
+                record("getMask", bytes + img.total(),
+                       bestTime(reps, [&]() { getMask(img, mask); }));
+                record("getStats", bytes + img.total(),
+                       bestTime(reps, [&]() { getStats(img, mask); }));
+            }
+        }
+    }
+
+    if (!jsonFile.empty())
+    {
+        ofstream out(jsonFile.c_str());
+        out << "[\n" << json.str() << "\n]" << endl;
+        if (!out)
+            cout << "error write " << jsonFile << endl;
+    }
+
+    if (failed)
+        cout << failed << " golden checks failed" << endl;
+    return failed;
+}
+
+//===== auto-tuning ====
+
+// Target means for --tune, as getStats reports them; spaces left out of
+// the target are not compared
+struct TuneTarget
+{
+    bool use[3];        // RGB, Lab, HSV
+    float mean[9];      // R G B, Lab L a b, H S V
+};
+
+// Squared distance of the statistics from the target
+static double tuneError(const AdjustStats& s, const TuneTarget& t)
+{
+    const float* got[3] = { s.rgb, s.lab, s.hsv };
+    double e = 0;
+    for (int k = 0; k < 3; k++)
+    {
+        if (!t.use[k])
+            continue;
+        for (int c = 0; c < 3; c++)
+        {
+            double d = got[k][c] - t.mean[k*3 + c];
+            e += d * d;
+        }
+    }
+    return e;
+}
+
+// A slider the tuner may move: its field, trackbar range as an offset and
+// first search step
+struct TuneParam
+{
+    const char* name;
+    int AdjustParams::*field;
+    int lo, hi, step;
+};
+
+static const TuneParam tuneParams[] = {
+    { "brightness", &AdjustParams::brightness, -255, 255, 32 },
+    { "contrast", &AdjustParams::contrast, -255, 255, 32 },
+    { "l", &AdjustParams::l, -255, 255, 32 },
+    { "a", &AdjustParams::a, -255, 255, 32 },
+    { "b", &AdjustParams::b, -255, 255, 32 },
+    { "h", &AdjustParams::hue, -180, 180, 16 },
+    { "s", &AdjustParams::saturation, -255, 255, 32 },
+    { "i", &AdjustParams::ilumination, -255, 255, 32 },
+    { "cR", &AdjustParams::cR, -255, 255, 32 },
+    { "cG", &AdjustParams::cG, -255, 255, 32 },
+    { "cB", &AdjustParams::cB, -255, 255, 32 },
+    { "ga", &AdjustParams::ga, 1, 50, 4 },
+};
+
+/**
+ * Solve for slider values that bring the masked means to a target
+ *
+ * Works on a pyramid proxy of the image, at least proxySize pixels on its
+ * long side, whose getMask region and blend weights are built once; every
+ * evaluation is one AdjustGraph pass and one exact getStats pass over the
+ * proxy. The search is a compass search, coordinate descent over all free
+ * sliders at once: each round tries every free slider one step up and one
+ * step down, evaluates these candidates on all cores, and moves to the best
+ * one if it lowers the error. When none does, the steps are halved; the
+ * search ends when all steps are 1 and nothing improves, or after
+ * maxRounds rounds. The result is checked once on the full image.
+ *
+ * @param names [in] sliders to tune, all twelve if empty
+ * @param presetOut [in] preset file for the result, none if empty
+ * @return 0 if success
+ */
+static int runTune(const string& input, const string& presetOut, AdjustParams start,
+                   const TuneTarget& target, const vector<string>& names,
+                   int proxySize, int maxRounds, int threads)
+{
+    Mat img = imread(input);
+    if ( !img.data )
+    {
+        cout << "error read image " << input << endl;
+        return -1;
+    }
+
+    vector<TuneParam> tuned;
+    for (size_t i = 0; i < sizeof(tuneParams) / sizeof(tuneParams[0]); i++)
+    {
+        if (names.empty() || std::find(names.begin(), names.end(), tuneParams[i].name) != names.end())
+            tuned.push_back(tuneParams[i]);
+    }
+    if (tuned.size() != (names.empty() ? sizeof(tuneParams) / sizeof(tuneParams[0]) : names.size()))
+    {
+        cout << "error unknown slider in --tune-params" << endl;
+        return -1;
+    }
+
+    Mat proxy = previewProxy(img, proxySize, proxySize);
+    Mat mask, weight;
+    getMask(proxy, mask);
+    if (start.region != REGION_ALL)
+        regionWeight(mask, start.region, start.feather * proxy.cols / img.cols, weight);
+
+    auto evaluate = [&](const AdjustParams& p, Mat& out) {
+        AdjustGraph graph(p);
+        if (p.region == REGION_ALL)
+            graph.run(proxy, out);
+        else
+            graph.runMasked(proxy, out, weight);
+        return tuneError(getStats(out, mask), target);
+    };
+
+    vector<int> steps;
+    for (size_t k = 0; k < tuned.size(); k++)
+    {
+        steps.push_back(tuned[k].step);
+        start.*tuned[k].field = CLIP_RANGE(start.*tuned[k].field, tuned[k].lo, tuned[k].hi);
+    }
+
+    AdjustParams best = start;
+    vector<Mat> outs(2 * tuned.size());
+    double bestErr = evaluate(best, outs[0]);
+    int64 t0 = getTickCount();
+    int rounds = 0, evaluations = 1;
+    setNumThreads(1);
+
+    for ( ; rounds < maxRounds && bestErr > 1e-6; rounds++)
+    {
+        // candidate 2k moves slider k up, 2k+1 down
+        vector<AdjustParams> cand(2 * tuned.size(), best);
+        vector<double> err(cand.size(), 1e30);
+        for (size_t k = 0; k < tuned.size(); k++)
+        {
+            cand[2*k].*tuned[k].field = std::min(best.*tuned[k].field + steps[k], tuned[k].hi);
+            cand[2*k+1].*tuned[k].field = std::max(best.*tuned[k].field - steps[k], tuned[k].lo);
+        }
+
+        // one candidate per thread at a time, the kernels inside run
+        // single-threaded
+        atomic<size_t> next(0);
+        vector<thread> workers;
+        for (int t = 0; t < threads; t++)
+        {
+            workers.push_back(thread([&]() {
+                for (size_t i = next++; i < cand.size(); i = next++)
+                {
+                    if (!sameParams(cand[i], best))
+                        err[i] = evaluate(cand[i], outs[i]);
+                }
+            }));
+        }
+        for (size_t t = 0; t < workers.size(); t++)
+            workers[t].join();
+        evaluations += (int)cand.size();
+
+        size_t pick = std::min_element(err.begin(), err.end()) - err.begin();
+        if (err[pick] < bestErr)
+        {
+            best = cand[pick];
+            bestErr = err[pick];
+            continue;
+        }
+
+        bool refined = false;
+        for (size_t k = 0; k < steps.size(); k++)
+        {
+            if (steps[k] > 1)
+            {
+                steps[k] /= 2;
+                refined = true;
+            }
+        }
+        if (!refined)
+            break;
+    }
+    double sec = (getTickCount() - t0) / getTickFrequency();
+    setNumThreads(threads);
+
+    // the proxy is an estimate, report what the preset does at full size
+    Mat out, fullMask, fullWeight;
+    getMask(img, fullMask);
+    AdjustGraph graph(best);
+    if (best.region == REGION_ALL)
+        graph.run(img, out);
+    else
+    {
+        regionWeight(fullMask, best.region, best.feather, fullWeight);
+        graph.runMasked(img, out, fullWeight);
+    }
+    AdjustStats stats = getStats(out, fullMask);
+
+    cout << rounds << " rounds, " << evaluations << " evaluations on " << proxy.cols << "x" << proxy.rows
+         << " in " << sec << " s, proxy error " << sqrt(bestErr)
+         << ", full size error " << sqrt(tuneError(stats, target)) << endl;
+    for (size_t k = 0; k < tuned.size(); k++)
+        cout << tuned[k].name << " = " << best.*tuned[k].field << endl;
+    cout << "rst:" << stats.rgb[0] << "," << stats.rgb[1] << "," << stats.rgb[2] << ","
+         << stats.lab[0] << "," << stats.lab[1] << "," << stats.lab[2] << ","
+         << stats.hsv[0] << "," << stats.hsv[1] << "," << stats.hsv[2] << endl;
+
+    if (!presetOut.empty() && !savePreset(presetOut, best))
+    {
+        cout << "error write preset " << presetOut << endl;
+        return -1;
+    }
+    return 0;
+}
+
+static void usage()
+{
+    cout << "usage: imgAdjust [image [threads]]" << endl
+         << "       imgAdjust --dir <dir> | --list <manifest> --out <dir>" << endl
+         << "       imgAdjust --stream <in.ppm> --out <out.ppm> [--strip <rows>]" << endl
+         << "       imgAdjust --video <in> --out <out> [--fourcc MJPG] [--mask-every <n>] [--ema <w>]" << endl
+         << "       imgAdjust --bench <reps> [--sizes 1,12,24,50,100] [--bench-threads 1,8] [--json <file>]" << endl
+         << "       imgAdjust --serve <socket> | - [--cache <presets>] [--queue <n>] [--threads <n>]" << endl
+         << "       imgAdjust --tune <image> [--target-rgb r,g,b] [--target-lab l,a,b] [--target-hsv h,s,v]" << endl
+         << "                 [--tune-params h,s,i] [--proxy <px>] [--rounds <n>] [--out <preset>]" << endl
+         << "                 [--preset <file>] [--csv <file>] [--threads <n>]" << endl
+         << "                 [--decoders <n>] [--encoders <n>] [--queue <n>] [--raw 0|1] [--cube <file>|<n>]" << endl
+         << "                 [--brightness v] [--contrast v] [--l v] [--a v] [--b v]" << endl
+         << "                 [--h v] [--s v] [--i v] [--cR v] [--cG v] [--cB v] [--ga v]" << endl
+         << "                 [--region 0|1|2] [--feather px]" << endl
+         << "values are offsets from neutral (0, ga 10), flags override the preset" << endl
+         << "region 1 adjusts inside the getMask region only, 2 outside it" << endl
+         << ".bgr inputs are memory-mapped, --raw 1 writes .bgr outputs; without it" << endl
+         << "       .bgr inputs are written as .tif" << endl
+         << "--cube n bakes the chain into an n^3 3D LUT for 8-bit images, --cube <file>" << endl
+         << "       applies a .cube file instead of the chain (8-bit images only)" << endl
+         << "16-bit inputs keep their depth, float inputs must be in [0, 1] (HDR is clipped)" << endl
+         << "video in/out may be frame sequences such as frames/%05d.png" << endl
+         << "--bench runs the golden checks, then times each kernel (sizes in MP)" << endl
+         << "--serve takes \"adjust <in> <out> [preset=<file>] [cube=<n>] [name=value ...]\"" << endl
+         << "        lines on a Unix socket or on stdin (-), \"quit\" stops it" << endl
+         << "--tune searches from the preset for sliders that bring the getMask region" << endl
+         << "       means of the image to the targets, on a proxy at least <px> on its long side" << endl;
+}
+
+// Parse the command line of batch mode and run it
+static int batchMain(int argc, char** argv)
+{
+    string dir, manifest, outDir, preset, csvFile, stream, video;
+    string fourcc = "MJPG";
+    int maskEvery = 10;
+    float emaWeight = 0.1f;
+    int threads = std::max(1, (int)thread::hardware_concurrency());
+    int decoders = 0, encoders = 0, queueSize = 0;
+    int strip = 256;
+    bool rawOut = false;
+    int benchReps = 0;
+    string sizes = "1,12,24,50,100", benchThreads, jsonFile;
+    string serve;
+    int cacheSize = 16;
+    string tune, tuneParamList;
+    string cubeArg;
+    string targets[3];
+    int proxySize = 256, rounds = 200;
+    vector<pair<string, int> > overrides;
+
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg.compare(0, 2, "--") != 0 || i + 1 >= argc)
+        {
+            usage();
+            return -1;
+        }
+        string key = arg.substr(2);
+        string value = argv[++i];
+        bool ok = true;
+        int number = 0;
+        double real = 0;
+
+        if (key == "dir") dir = value;
+        else if (key == "list") manifest = value;
+        else if (key == "out") outDir = value;
+        else if (key == "preset") preset = value;
+        else if (key == "csv") csvFile = value;
+        else if (key == "threads") ok = parseInt(value, threads);
+        else if (key == "decoders") ok = parseInt(value, decoders);
+        else if (key == "encoders") ok = parseInt(value, encoders);
+        else if (key == "queue") ok = parseInt(value, queueSize);
+        else if (key == "stream") stream = value;
+        else if (key == "strip") ok = parseInt(value, strip);
+        else if (key == "raw") { ok = parseInt(value, number); rawOut = number != 0; }
+        else if (key == "cube") cubeArg = value;
+        else if (key == "video") video = value;
+        else if (key == "fourcc") fourcc = value;
+        else if (key == "mask-every") ok = parseInt(value, maskEvery);
+        else if (key == "ema") { ok = parseDouble(value, real); emaWeight = (float)real; }
+        else if (key == "bench") ok = parseInt(value, benchReps);
+        else if (key == "sizes") sizes = value;
+        else if (key == "bench-threads") benchThreads = value;
+        else if (key == "json") jsonFile = value;
+        else if (key == "serve") serve = value;
+        else if (key == "cache") ok = parseInt(value, cacheSize);
+        else if (key == "tune") tune = value;
+        else if (key == "target-rgb") targets[0] = value;
+        else if (key == "target-lab") targets[1] = value;
+        else if (key == "target-hsv") targets[2] = value;
+        else if (key == "tune-params") tuneParamList = value;
+        else if (key == "proxy") ok = parseInt(value, proxySize);
+        else if (key == "rounds") ok = parseInt(value, rounds);
+        else { ok = parseInt(value, number); overrides.push_back(make_pair(key, number)); }
+
+        if (!ok)
+        {
+            cout << "error bad number for --" << key << ": " << value << endl;
+            return -1;
+        }
+    }
+
+    if (benchReps > 0)
+    {
+        vector<double> benchSizes, threadCounts;
+        if (!parseList(sizes, benchSizes) || !parseList(benchThreads, threadCounts))
+        {
+            usage();
+            return -1;
+        }
+        if (threadCounts.empty())
+        {
+            threadCounts.push_back(1);
+            if (threads > 1)
+                threadCounts.push_back(threads);
+        }
+        return runBench(benchSizes, threadCounts, benchReps, jsonFile) == 0 ? 0 : 1;
+    }
+    if (!serve.empty())
+    {
+        // a client that goes away must not take the service with it
+        signal(SIGPIPE, SIG_IGN);
+        setNumThreads(std::max(1, threads));
+        AdjustServer server(std::max(1, cacheSize), queueSize > 0 ? queueSize : 64);
+        return (serve == "-" ? server.serveStdio() : server.serveSocket(serve)) == 0 ? 0 : 1;
+    }
+
+    if (tune.empty() && ((dir.empty() + manifest.empty() + stream.empty() + video.empty() != 3) || outDir.empty()))
+    {
+        usage();
+        return -1;
+    }
+
+    AdjustParams params;
+    string error;
+    if (!preset.empty() && !loadPreset(preset, params, error))
+    {
+        cout << "error read preset " << preset << " " << error << endl;
+        return -1;
+    }
+    for (size_t i = 0; i < overrides.size(); i++)
+    {
+        if (!setParam(params, overrides[i].first, overrides[i].second))
+        {
+            usage();
+            return -1;
+        }
+    }
+
+    if (!tune.empty())
+    {
+        TuneTarget target;
+        bool any = false;
+        for (int k = 0; k < 3; k++)
+        {
+            vector<double> mean;
+            target.use[k] = !targets[k].empty();
+            if (!parseList(targets[k], mean) || (target.use[k] && mean.size() != 3))
+            {
+                usage();
+                return -1;
+            }
+            for (int c = 0; c < 3; c++)
+                target.mean[k*3 + c] = target.use[k] ? (float)mean[c] : 0.0f;
+            any = any || target.use[k];
+        }
+        if (!any)
+        {
+            usage();
+            return -1;
+        }
+
+        vector<string> names;
+        stringstream ss(tuneParamList);
+        string name;
+        while (getline(ss, name, ','))
+        {
+            if (!name.empty())
+                names.push_back(name);
+        }
+        return runTune(tune, outDir, params, target, names, std::max(1, proxySize),
+                       std::max(1, rounds), std::max(1, threads)) == 0 ? 0 : 1;
+    }
+    if (!stream.empty())
+    {
+        // one image, the kernels share the threads
+        setNumThreads(std::max(1, threads));
+        return streamImage(stream, outDir, params, strip) == 0 ? 0 : 1;
+    }
+    if (!video.empty())
+    {
+        setNumThreads(std::max(1, threads));
+        return runVideo(video, outDir, fourcc, params, csvFile, maskEvery, emaWeight) == 0 ? 0 : 1;
+    }
+
+    vector<string> files;
+    if (!listInputs(dir, manifest, files))
+    {
+        cout << "error read manifest " << manifest << endl;
+        return -1;
+    }
+
+    // outputs are named after the input file name only, so two inputs with
+    // the same name would overwrite each other, and an output directory
+    // that holds the inputs would overwrite them
+    map<string, size_t> outputs;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        if (sameFile(dirName(files[i]), outDir))
+        {
+            cout << "error output directory holds input " << files[i] << endl;
+            return -1;
+        }
+        string output = batchOutput(outDir, files[i], rawOut);
+        if (!outputs.insert(make_pair(output, i)).second)
+        {
+            cout << "error " << files[outputs[output]] << " and " << files[i]
+                 << " both write " << output << endl;
+            return -1;
+        }
+    }
+
+    // by default decoding and encoding share as many threads as adjustment
+    threads = std::max(1, threads);
+    decoders = decoders > 0 ? decoders : std::max(1, threads / 2);
+    encoders = encoders > 0 ? encoders : std::max(1, threads / 2);
+    queueSize = queueSize > 0 ? queueSize : 2 * threads;
+
+    // a size bakes the chain, anything else is a .cube file that replaces it
+    ColorCube cube;
+    bool cubeOnly = false;
+    if (!cubeArg.empty())
+    {
+        int size;
+        if (parseInt(cubeArg, size))
+        {
+            if (size < 2 || size > 256)
+            {
+                cout << "error cube size " << size << " is not in [2, 256]" << endl;
+                return -1;
+            }
+            cube.bake(AdjustGraph(params), size);
+        }
+        else if (cube.load(cubeArg))
+            cubeOnly = true;
+        else
+        {
+            cout << "error read cube " << cubeArg << endl;
+            return -1;
+        }
+    }
+
+    return runBatch(files, outDir, params, csvFile, decoders, threads, encoders, queueSize,
+                    rawOut, cube, cubeOnly) == 0 ? 0 : 1;
+}
+  
+  
+int main(int argc, char** argv)  
+{  
+    if(argc > 1 && argv[1][0] == '-')
+    {
+        int rst = batchMain(argc, argv);
+        IMGADJUST_PROFILE_REPORT();
+        return rst;
+    }
+
+    char * filename = "test.jpg";
+    if(argc > 1)
+    {   
+        filename = argv[1];
+    } 
+    // kernels use all cores unless a thread count is given
+    int threads;
+    if(argc > 2 && parseInt(argv[2], threads))
+    {
+        setNumThreads(threads);
+    }
+
+    src = imread(filename);  
+  
+    if ( !src.data ) {  
+        cout << "error read image" << endl;  
+        return -1;  
+    }  
+    dst.create(src.size(), src.type());  
+    proxy = previewProxy(src, 1024, 1080);
+  
+    namedWindow(window_name, CV_WINDOW_NORMAL| CV_WINDOW_KEEPRATIO| CV_GUI_EXPANDED);  
+    namedWindow(window_src, CV_WINDOW_NORMAL| CV_WINDOW_KEEPRATIO| CV_GUI_EXPANDED);  
+    namedWindow(window_img, CV_WINDOW_NORMAL| CV_WINDOW_KEEPRATIO| CV_GUI_EXPANDED);  
+    resizeWindow(window_img, 1024, 1080);
+    createTrackbar("brightness", window_name, &brightness, 2*brightness, callbackAdjust);  
+    createTrackbar("contrast", window_name, &contrast, 2*contrast, callbackAdjust);  
+
+    createTrackbar("l", window_name, &l, 2*l, callbackAdjust);  
+    createTrackbar("a", window_name, &a, 2*a, callbackAdjust);  
+    createTrackbar("b", window_name, &b, 2*b, callbackAdjust);  
+
+    createTrackbar("h", window_name, &hue, 2*hue, callbackAdjust);  
+    createTrackbar("s", window_name, &saturation, 2*saturation, callbackAdjust);  
+    createTrackbar("i", window_name, &ilumination, 2*ilumination, callbackAdjust);  
+
+    createTrackbar("cR", window_name, &cR, 2*cR, callbackAdjust);
+    createTrackbar("cG", window_name, &cG, 2*cG, callbackAdjust);
+    createTrackbar("cB", window_name, &cB, 2*cB, callbackAdjust);
+
+    createTrackbar("ga", window_name, &ga, 50, callbackAdjust);
+
+    createTrackbar("region", window_name, &region, REGION_OUTSIDE, callbackAdjust);
+    createTrackbar("feather", window_name, &feather, 100, callbackAdjust);
+
+    renderFull();
+    imshow(window_src, src);
+  
+    // 'c' saves the current settings as a 3D LUT, any other key quits
+    for (;;)
+    {
+        int key = waitKey(50);
+        if ( key == -1 )
+        {
+            if ( fullPending && (getTickCount() - lastChange) / getTickFrequency() >= settleSec )
+                renderFull();
+            continue;
+        }
+#ifdef IMGADJUST_PROFILE
+        // 'p' prints the stage timings, 't' saves them as a Chrome trace
+        // and 'o' toggles the timing overlay
+        if ( (char)key == 'p' )
+        {
+            profiler().report();
+            continue;
+        }
+        if ( (char)key == 't' )
+        {
+            if ( profiler().saveTrace("imgAdjust.trace.json") )
+                cout << "saved imgAdjust.trace.json" << endl;
+            else
+                cout << "error write imgAdjust.trace.json" << endl;
+            continue;
+        }
+        if ( (char)key == 'o' )
+        {
+            profiler().overlay = !profiler().overlay;
+            renderFull();
+            continue;
+        }
+#endif
+        if ( (char)key != 'c' )
+            break;
+
+        ColorCube cube;
+        cube.bake(AdjustGraph(trackbarParams()));
+        if ( cube.save("imgAdjust.cube") )
+            cout << "saved imgAdjust.cube" << endl;
+        else
+            cout << "error write imgAdjust.cube" << endl;
+    }
+    cout << "pool scratch (main thread): " << scratchPool().hits() << " hits, "
+         << scratchPool().misses() << " misses" << endl;
+    IMGADJUST_PROFILE_REPORT();
 
     return 0;  
   
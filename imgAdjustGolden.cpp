@@ -0,0 +1,415 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "opencv2/core.hpp"
+#include "opencv2/imgproc.hpp"
+#include "imgAdjustGolden.h"
+
+using namespace std;
+using namespace cv;
+using namespace imgadjust;
+
+#define CLIP_RANGE(value, min, max)  ( (value) > (max) ? (max) : (((value) < (min)) ? (min) : (value)) )
+#define COLOR_RANGE(value)  CLIP_RANGE(value, 0, 255)
+
+
+Mat syntheticImage(int rows, int cols, int depth)
+{
+    CV_Assert(depth == CV_8U || depth == CV_16U);
+    Mat img(rows, cols, CV_MAKETYPE(depth, 3));
+    uint32_t seed = 12345;
+    for (int i = 0; i < rows; i++)
+    {
+        for (int j = 0; j < cols; j++)
+        {
+            seed = seed * 1664525u + 1013904223u;
+            int noise = (int)(seed >> 24) & 15;
+            int v[3] = { j * 255 / std::max(cols - 1, 1),
+                         i * 255 / std::max(rows - 1, 1),
+                         ((i + j) * 7 + noise * 8) & 255 };
+            for (int c = 0; c < 3; c++)
+            {
+                int x = COLOR_RANGE(v[c] + noise - 8);
+                if (depth == CV_8U)
+                    img.ptr<uchar>(i)[j*3+c] = (uchar)x;
+                else
+                    img.ptr<ushort>(i)[j*3+c] = (ushort)std::min(x * 257 + (int)((seed >> (8 + 4*c)) & 255), 65535);
+            }
+        }
+    }
+    return img;
+}
+
+// Reference kernels for the golden checks: the original per-pixel code of
+// each adjustment on the whole image, without the lookup tables, folding,
+// strips, bands and SIMD of the real kernels
+static void refBrightnessContrast(const Mat& img, Mat& out, int brightness, int contrast)
+{
+    double B = brightness / 255.;
+    double k = tan( (45 + 44 * (contrast / 255.)) / 180 * M_PI );
+    out.create(img.size(), img.type());
+    for (int i = 0; i < img.rows; i++)
+    {
+        const uchar* p = img.ptr<uchar>(i);
+        uchar* q = out.ptr<uchar>(i);
+        for (int j = 0; j < img.cols*3; j++)
+            q[j] = COLOR_RANGE( (p[j] - 127.5 * (1 - B)) * k + 127.5 * (1 + B) );
+    }
+}
+
+static void refShift(const Mat& img, Mat& out, int toCode, int fromCode,
+                     int d0, int d1, int d2, int max0)
+{
+    Mat temp;
+    cvtColor(img, temp, toCode);
+    for (int i = 0; i < temp.rows; i++)
+    {
+        uchar* p = temp.ptr<uchar>(i);
+        for (int j = 0; j < temp.cols; j++)
+        {
+            float val = p[j*3] + d0;
+            if ( val < 0) val = 0;
+            if ( val > max0 ) val = max0;
+            p[j*3] = val;
+
+            val = p[j*3+1] + d1;
+            if ( val < 0) val = 0;
+            if ( val > 255 ) val = 255;
+            p[j*3+1] = val;
+
+            val = p[j*3+2] + d2;
+            if ( val < 0) val = 0;
+            if ( val > 255 ) val = 255;
+            p[j*3+2] = val;
+        }
+    }
+    cvtColor(temp, out, fromCode);
+}
+
+static void refColorBalance(const Mat& img, Mat& out, int c0, int c1, int c2)
+{
+    int d[3] = { c0, c1, c2 };
+    out.create(img.size(), img.type());
+    for (int i = 0; i < img.rows; i++)
+    {
+        const uchar* p = img.ptr<uchar>(i);
+        uchar* q = out.ptr<uchar>(i);
+        for (int j = 0; j < img.cols*3; j++)
+            q[j] = saturate_cast<uchar>(p[j] + d[j % 3]);
+    }
+}
+
+static void refGamma(const Mat& img, Mat& out, float ga)
+{
+    ga = ga / 10.0;
+    if ( ga<0.1) ga = -0.1;
+    if ( ga> 5.0) ga = 5.0;
+    out.create(img.size(), img.type());
+    for (int i = 0; i < img.rows; i++)
+    {
+        const uchar* p = img.ptr<uchar>(i);
+        uchar* q = out.ptr<uchar>(i);
+        for (int j = 0; j < img.cols*3; j++)
+            q[j] = saturate_cast<uchar>(cv::pow((float)(p[j]/255.0), ga) * 255.0f);
+    }
+}
+
+static void refMask(const Mat& img, Mat& mask)
+{
+    Mat hsv;
+    cvtColor(img, hsv, CV_BGR2HSV);
+    mask.create(img.size(), CV_8UC1);
+    for (int i = 0; i < img.rows; i++)
+    {
+        const uchar* p = img.ptr<uchar>(i);
+        const uchar* h = hsv.ptr<uchar>(i);
+        uchar* m = mask.ptr<uchar>(i);
+        for (int j = 0; j < img.cols; j++)
+        {
+            bool inside = (p[j*3]<200 || p[j*3+1]<200 || p[j*3+2]<200) &&
+                          (h[j*3]<30 || 180 - h[j*3]<20);
+            m[j] = inside ? 255 : 0;
+        }
+    }
+}
+
+// callbackAdjust's chain, one whole-image reference kernel after another
+static void refChain(const Mat& img, Mat& out, const AdjustParams& p)
+{
+    Mat t;
+    refBrightnessContrast(img, t, p.brightness, p.contrast);
+    refShift(t, t, CV_BGR2Lab, CV_Lab2BGR, p.l, p.a, p.b, 255);
+    refShift(t, t, CV_BGR2HSV, CV_HSV2BGR, p.hue, p.saturation, p.ilumination, 180);
+    refColorBalance(t, t, p.cB, p.cG, p.cR);
+    refGamma(t, out, p.ga);
+}
+
+// The chain on a CV_16UC3 image, pixel by pixel through ToneCurve and
+// whole-image float conversions
+static void refDeepChain(const Mat& img, Mat& out, const AdjustParams& p)
+{
+    ToneCurve curve(p.brightness, p.contrast, p.cB, p.cG, p.cR, p.ga);
+    DeepShift shifts[2] = { labShift(p.l, p.a, p.b), hsvShift(p.hue, p.saturation, p.ilumination) };
+
+    out.create(img.size(), img.type());
+    for (int i = 0; i < img.rows; i++)
+    {
+        const ushort* s = img.ptr<ushort>(i);
+        ushort* q = out.ptr<ushort>(i);
+        for (int j = 0; j < img.cols*3; j++)
+            q[j] = saturate_cast<ushort>(curve.pre(s[j] / 65535.f) * 65535.f);
+    }
+
+    Mat f;
+    for (int k = 0; k < 2; k++)
+    {
+        const DeepShift& d = shifts[k];
+        out.convertTo(f, CV_32F, 1.0 / 65535);
+        cvtColor(f, f, d.toCode);
+        for (int i = 0; i < f.rows; i++)
+        {
+            float* v = f.ptr<float>(i);
+            for (int j = 0; j < f.cols*3; j++)
+                v[j] = std::min(std::max(v[j] + d.d[j % 3], d.lo[j % 3]), d.hi[j % 3]);
+        }
+        cvtColor(f, f, d.fromCode);
+        f.convertTo(out, CV_16U, 65535);
+    }
+
+    for (int i = 0; i < out.rows; i++)
+    {
+        ushort* q = out.ptr<ushort>(i);
+        for (int j = 0; j < out.cols*3; j++)
+            q[j] = saturate_cast<ushort>(curve.post(q[j] / 65535.f, j % 3) * 65535.f);
+    }
+}
+
+// Print one golden check line, true if no value of out differs from ref by
+// more than tol
+static bool goldenCheck(const string& name, const Mat& out, const Mat& ref, double tol)
+{
+    double diff = out.size() == ref.size() && out.type() == ref.type() ?
+                  norm(out, ref, NORM_INF) : 1e30;
+    bool ok = diff <= tol;
+    cout << "golden " << name << ": " << (ok ? "ok" : "FAIL") << " (max diff " << diff << ")" << endl;
+    return ok;
+}
+
+// Print one depth check line, true if out scaled back by 1/scale is within
+// a mean of tol 8-bit levels of the 8-bit reference
+static bool depthCheck(const string& name, const Mat& out, const Mat& ref8, double scale, double tol)
+{
+    Mat o, r;
+    out.convertTo(o, CV_32F, 1.0 / scale);
+    ref8.convertTo(r, CV_32F);
+    double meanDiff = o.size() == r.size() ? norm(o, r, NORM_L1) / ((double)r.total() * 3) : 1e30;
+    bool ok = meanDiff <= tol;
+    cout << "golden " << name << ": " << (ok ? "ok" : "FAIL") << " (mean diff " << meanDiff << ")" << endl;
+    return ok;
+}
+
+/**
+ * Compare every kernel with its reference on a test image
+ *
+ * 8-bit kernels must match the original code bit for bit; getStats must
+ * match cv::mean over the reference mask; the 16-bit chain may differ by
+ * rounding only. The 8-bit image widened to 16 bits (x257) and to float
+ * (/255) must grade like refChain, which shares no code with the deep
+ * path; the 8-bit chain rounds after every stage, so only the mean
+ * difference is bounded. The odd size puts band, strip and SIMD tails
+ * everywhere.
+ *
+ * @return number of failed checks
+ */
+int runGolden(const AdjustParams& p)
+{
+    int failed = 0;
+    Mat img = syntheticImage(479, 641, CV_8U);
+    Mat out, ref;
+
+    adjustBrightnessContrast(img, out, p.brightness, p.contrast);
+    refBrightnessContrast(img, ref, p.brightness, p.contrast);
+    failed += !goldenCheck("brightnessContrast", out, ref, 0);
+
+    AdjustLAB(img, out, p.l, p.a, p.b);
+    refShift(img, ref, CV_BGR2Lab, CV_Lab2BGR, p.l, p.a, p.b, 255);
+    failed += !goldenCheck("AdjustLAB", out, ref, 0);
+
+    AdjustHSI(img, out, p.hue, p.saturation, p.ilumination);
+    refShift(img, ref, CV_BGR2HSV, CV_HSV2BGR, p.hue, p.saturation, p.ilumination, 180);
+    failed += !goldenCheck("AdjustHSI", out, ref, 0);
+
+    ColorBalance(img, out, p.cB, p.cG, p.cR);
+    refColorBalance(img, ref, p.cB, p.cG, p.cR);
+    failed += !goldenCheck("ColorBalance", out, ref, 0);
+
+    GammaCorrect(img, out, p.ga);
+    refGamma(img, ref, p.ga);
+    failed += !goldenCheck("GammaCorrect", out, ref, 0);
+
+    Mat mask, refM;
+    getMask(img, mask);
+    refMask(img, refM);
+    failed += !goldenCheck("getMask", mask, refM, 0);
+
+    AdjustGraph graph(p);
+    graph.run(img, out);
+    refChain(img, ref, p);
+    failed += !goldenCheck("chain", out, ref, 0);
+
+    // statistics of the adjusted image over the mask of the source
+    AdjustStats s = getStats(out, refM);
+    Mat lab, hsv;
+    cvtColor(ref, lab, CV_BGR2Lab);
+    cvtColor(ref, hsv, CV_BGR2HSV);
+    Scalar m[3] = { mean(ref, refM), mean(lab, refM), mean(hsv, refM) };
+    double statsDiff = 0;
+    for (int c = 0; c < 3; c++)
+    {
+        statsDiff = std::max(statsDiff, (double)std::abs(s.rgb[c] - m[0][2 - c]));
+        statsDiff = std::max(statsDiff, (double)std::abs(s.lab[c] - m[1][c]));
+        statsDiff = std::max(statsDiff, (double)std::abs(s.hsv[c] - m[2][c]));
+    }
+    bool statsOk = statsDiff <= 1e-3;
+    cout << "golden getStats: " << (statsOk ? "ok" : "FAIL") << " (max diff " << statsDiff << ")" << endl;
+    failed += !statsOk;
+
+    Mat deep = syntheticImage(479, 641, CV_16U);
+    graph.run(deep, out);
+    refDeepChain(deep, ref, p);
+    failed += !goldenCheck("chain 16U", out, ref, 2);
+
+    Mat wide, ref8;
+    refChain(img, ref8, p);
+    img.convertTo(wide, CV_16U, 257);
+    graph.run(wide, out);
+    failed += !depthCheck("chain 8U as 16U", out, ref8, 257, 3);
+    img.convertTo(wide, CV_32F, 1.0 / 255);
+    graph.run(wide, out);
+    failed += !depthCheck("chain 8U as 32F", out, ref8, 1.0 / 255, 3);
+
+    return failed;
+}
+
+/**
+ * ColorCube against the exact chain
+ *
+ * The cube interpolates, so its output is compared by the mean difference
+ * from AdjustGraph rather than bit for bit. A cube saved as .cube and
+ * loaded again must give the same output up to the 6 decimals of the
+ * file. Only the typical preset and the identity are checked: the edge
+ * sets are near step functions, which no lattice follows closely.
+ *
+ * @return number of failed checks
+ */
+int runCubeGolden(const AdjustParams& p)
+{
+    int failed = 0;
+    Mat img = syntheticImage(479, 641, CV_8U);
+    Mat ref, out;
+    AdjustGraph graph(p);
+    graph.run(img, ref);
+
+    ColorCube cube;
+    cube.bake(graph, 33);
+    cube.apply(img, out);
+    double meanDiff = norm(out, ref, NORM_L1) / ((double)img.total() * 3);
+    bool ok = meanDiff <= 2.0;
+    cout << "golden ColorCube 33: " << (ok ? "ok" : "FAIL") << " (mean diff " << meanDiff << ")" << endl;
+    failed += !ok;
+
+    Mat tri;
+    cube.apply(img, tri, ColorCube::CUBE_TRILINEAR);
+    meanDiff = norm(tri, ref, NORM_L1) / ((double)img.total() * 3);
+    ok = meanDiff <= 2.0;
+    cout << "golden ColorCube 33 trilinear: " << (ok ? "ok" : "FAIL") << " (mean diff " << meanDiff << ")" << endl;
+    failed += !ok;
+
+    // save -> load round trip through a file next to the system temp files
+    char path[] = "/tmp/imgAdjustGoldenXXXXXX";
+    int fd = mkstemp(path);
+    ColorCube loaded;
+    bool roundTrip = fd >= 0 && cube.save(path) && loaded.load(path) && loaded.size() == cube.size();
+    if (fd >= 0)
+    {
+        ::close(fd);
+        ::unlink(path);
+    }
+    if (roundTrip)
+    {
+        Mat again;
+        loaded.apply(img, again);
+        failed += !goldenCheck("ColorCube save/load", again, out, 1);
+    }
+    else
+    {
+        cout << "golden ColorCube save/load: FAIL (cannot save or load " << path << ")" << endl;
+        failed++;
+    }
+
+    return failed;
+}
+
+vector<AdjustParams> goldenParams()
+{
+    vector<AdjustParams> sets;
+
+    AdjustParams p;
+    p.brightness = 30;  p.contrast = 20;
+    p.l = 10;   p.a = -5;   p.b = 7;
+    p.hue = 8;  p.saturation = -20;    p.ilumination = 15;
+    p.cR = 12;  p.cG = -7;  p.cB = 5;
+    p.ga = 12;
+    sets.push_back(p);
+
+    // all sliders neutral, every stage must leave the image alone
+    sets.push_back(AdjustParams());
+
+    // every slider at its top and at its bottom end
+    p.brightness = p.contrast = p.l = p.a = p.b = 255;
+    p.saturation = p.ilumination = p.cR = p.cG = p.cB = 255;
+    p.hue = 180;
+    p.ga = 50;
+    sets.push_back(p);
+
+    p.brightness = p.contrast = p.l = p.a = p.b = -255;
+    p.saturation = p.ilumination = p.cR = p.cG = p.cB = -255;
+    p.hue = -180;
+    // the trackbar minimum, the only value that takes the gamma -0.1 branch
+    p.ga = 0;
+    sets.push_back(p);
+
+    // neighbouring sliders at opposite ends
+    p.brightness = 255;  p.contrast = -255;
+    p.l = -255; p.a = 255;  p.b = -255;
+    p.hue = 180;    p.saturation = -255;    p.ilumination = 255;
+    p.cR = -255;    p.cG = 255;     p.cB = -255;
+    p.ga = 1;
+    sets.push_back(p);
+
+    return sets;
+}
+
+int runGoldenSets()
+{
+    vector<AdjustParams> sets = goldenParams();
+    int failed = 0;
+    for (size_t i = 0; i < sets.size(); i++)
+    {
+        const AdjustParams& p = sets[i];
+        cout << "golden set " << i << ": brightness " << p.brightness << ", contrast " << p.contrast
+             << ", lab " << p.l << "," << p.a << "," << p.b
+             << ", hsi " << p.hue << "," << p.saturation << "," << p.ilumination
+             << ", balance " << p.cR << "," << p.cG << "," << p.cB << ", ga " << p.ga << endl;
+        failed += runGolden(p);
+
+        // the typical preset and the identity, see runCubeGolden
+        if (i < 2)
+            failed += runCubeGolden(p);
+    }
+    return failed;
+}
@@ -0,0 +1,37 @@
+/**
+ * Golden checks of the imgAdjustLib kernels
+ *
+ * Every kernel is compared with the original per-pixel code on a synthetic
+ * image, for a typical preset and for parameter sets at the ends of every
+ * slider, where the saturating and clamping paths of the SIMD kernels are
+ * taken. imgAdjust --bench runs them before timing anything, and the
+ * goldenTest executable runs them on their own for ctest.
+ */
+#ifndef IMGADJUST_GOLDEN_H
+#define IMGADJUST_GOLDEN_H
+
+#include <vector>
+#include "opencv2/core.hpp"
+#include "imgAdjustLib.h"
+
+
+// Deterministic BGR test image of the given depth (CV_8U or CV_16U):
+// gradients for a spread of hues, so getMask finds a region, plus noise
+// from a fixed LCG so runs are comparable
+cv::Mat syntheticImage(int rows, int cols, int depth);
+
+// the typical preset first, then the identity and the edge sets
+std::vector<imgadjust::AdjustParams> goldenParams();
+
+// check every kernel with p, @return number of failed checks
+int runGolden(const imgadjust::AdjustParams& p);
+
+// ColorCube baked from p against the exact chain, and its .cube round
+// trip, @return number of failed checks
+int runCubeGolden(const imgadjust::AdjustParams& p);
+
+// runGolden on every goldenParams() set and runCubeGolden on the first
+// two, @return number of failed checks
+int runGoldenSets();
+
+#endif
@@ -0,0 +1,1476 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include "opencv2/core.hpp"
+#include "opencv2/core/hal/intrin.hpp"
+#include "opencv2/imgproc.hpp"
+#include "imgAdjustLib.h"
+
+using namespace std;
+using namespace cv;
+
+
+#define CLIP_RANGE(value, min, max)  ( (value) > (max) ? (max) : (((value) < (min)) ? (min) : (value)) )
+#define COLOR_RANGE(value)  CLIP_RANGE(value, 0, 255)
+#define SWAP(a, b, t)  do { t = a; a = b; b = t; } while(0)
+
+namespace imgadjust
+{
+
+#ifdef IMGADJUST_PROFILE
+void Profiler::record(const char* name, int64 t0, int64 t1)
+{
+    double us = (t1 - t0) * 1e6 / getTickFrequency();
+    int k = us <= 1 ? 0 : std::min((int)(8 * log2(us)), (int)BUCKETS - 1);
+
+    lock_guard<mutex> lock(m);
+    Histogram& h = stats[name];
+    h.count++;
+    h.maxUs = std::max(h.maxUs, us);
+    h.bucket[k]++;
+
+    if (events.size() < maxEvents)
+    {
+        map<thread::id, int>::iterator it = tids.find(this_thread::get_id());
+        if (it == tids.end())
+            it = tids.insert(make_pair(this_thread::get_id(), (int)tids.size())).first;
+        Event e = { name, t0, t1, it->second };
+        events.push_back(e);
+    }
+}
+
+// upper edge of the bucket holding the q-th sample
+double Profiler::percentile(const Histogram& h, double q) const
+{
+    long long seen = 0;
+    for (int k = 0; k < BUCKETS; k++)
+    {
+        seen += h.bucket[k];
+        if (seen >= q * h.count)
+            return std::min(pow(2.0, (k + 1) / 8.0), h.maxUs);
+    }
+    return h.maxUs;
+}
+
+vector<string> Profiler::lines() const
+{
+    lock_guard<mutex> lock(m);
+    vector<string> out;
+    for (map<string, Histogram>::const_iterator it = stats.begin(); it != stats.end(); ++it)
+    {
+        const Histogram& h = it->second;
+        stringstream ss;
+        ss.precision(3);
+        ss << it->first << ": n " << h.count << ", p50 " << percentile(h, 0.5) / 1000
+           << " ms, p99 " << percentile(h, 0.99) / 1000 << " ms, max " << h.maxUs / 1000 << " ms";
+        out.push_back(ss.str());
+    }
+    return out;
+}
+
+void Profiler::report() const
+{
+    vector<string> text = lines();
+    for (size_t i = 0; i < text.size(); i++)
+        cout << "profile " << text[i] << endl;
+}
+
+void Profiler::draw(Mat& img) const
+{
+    vector<string> text = lines();
+    for (size_t i = 0; i < text.size(); i++)
+        putText(img, text[i], Point(5, 20 + 20*(int)i), CV_FONT_HERSHEY_SIMPLEX, 0.5, Scalar(0,255,0), 1, 1);
+}
+
+bool Profiler::saveTrace(const string& filename) const
+{
+    ofstream out(filename.c_str());
+    if (!out)
+        return false;
+
+    lock_guard<mutex> lock(m);
+    double usPerTick = 1e6 / getTickFrequency();
+    out << "{\"traceEvents\": [" << endl;
+    for (size_t i = 0; i < events.size(); i++)
+    {
+        const Event& e = events[i];
+        out << (i ? ",\n" : "") << "{\"name\": \"" << e.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+            << e.tid << ", \"ts\": " << (e.t0 - start) * usPerTick << ", \"dur\": " << (e.t1 - e.t0) * usPerTick << "}";
+    }
+    out << "\n]}" << endl;
+    return (bool)out;
+}
+
+Profiler& profiler()
+{
+    static Profiler p;
+    return p;
+}
+#endif
+  
+// Rows per band when an image is split for parallel processing, a band is
+// about 256 KB so it stays in L2 while all steps run over it
+static int bandRows(const Mat& img, int bandBytes = 256*1024)
+{
+    int rowBytes = img.cols * (int)img.elemSize();
+    return std::max(1, bandBytes / std::max(1, rowBytes));
+}
+
+// Rows per strip of a band, about 32 KB so a strip and its converted copy
+// stay in L1
+static int stripRows(const Mat& img)
+{
+    return bandRows(img, 32*1024);
+}
+
+template<typename Fn>
+class RowBandBody : public ParallelLoopBody
+{
+public:
+    RowBandBody(int rows, int band, const Fn& fn) : rows(rows), band(band), fn(fn) {}
+
+    void operator()(const Range& r) const
+    {
+        for (int i = r.start; i < r.end; i++)
+            fn(i * band, std::min((i + 1) * band, rows));
+    }
+
+private:
+    int rows, band;
+    const Fn& fn;
+};
+
+// Call fn(rowStart, rowEnd) for consecutive bands of `band` rows on all
+// threads set with cv::setNumThreads. Bands are fixed by the image size, not
+// the thread count, and never overlap, so the output is the same however
+// many threads run.
+template<typename Fn>
+static void parallelRows(int rows, int band, const Fn& fn)
+{
+    int bands = (rows + band - 1) / band;
+    parallel_for_(Range(0, bands), RowBandBody<Fn>(rows, band, fn));
+}
+
+// cv::LUT over bands in parallel, dst may be the same Mat as img
+static void parallelLut(const Mat& img, const Mat& lut, Mat& dst)
+{
+    dst.create(img.size(), img.type());
+    parallelRows(img.rows, bandRows(img), [&](int y0, int y1) {
+        Mat out = dst.rowRange(y0, y1);
+        LUT(img.rowRange(y0, y1), lut, out);
+    });
+}
+
+// temporaries of the kernels, one pool per thread so concurrent calls
+// never share or wait for a buffer list
+MatPool& scratchPool()
+{
+    thread_local MatPool pool;
+    return pool;
+}
+
+// The top left rows x cols of scratch as a buffer of type. scratch is only
+// reallocated when it is too small, so one buffer sized for a full strip
+// also serves the shorter last strip and narrower tiles.
+static Mat scratchView(Mat& scratch, int rows, int cols, int type)
+{
+    if (scratch.rows < rows || scratch.cols < cols || scratch.type() != type)
+        scratch.create(rows, cols, type);
+    return scratch(Rect(0, 0, cols, rows));
+}
+  
+// Full scale of a sample type, float images are taken as [0, 1]
+template<typename T> struct SampleRange;
+template<> struct SampleRange<uchar> { static double scale() { return 255.0; } };
+template<> struct SampleRange<ushort> { static double scale() { return 65535.0; } };
+template<> struct SampleRange<float> { static double scale() { return 1.0; } };
+
+
+ToneCurve::ToneCurve(int brightness, int contrast, int c0, int c1, int c2, float ga)
+{
+    brightness = CLIP_RANGE(brightness, -255, 255);
+    contrast = CLIP_RANGE(contrast, -255, 255);
+    pre0 = brightness == 0 && contrast == 0;
+
+    // as in brightnessContrastLut
+    B = brightness / 255.;
+    k = tan( (45 + 44 * (contrast / 255.)) / 180 * M_PI );
+
+    offset[0] = CLIP_RANGE(c0, -255, 255) / 255.f;
+    offset[1] = CLIP_RANGE(c1, -255, 255) / 255.f;
+    offset[2] = CLIP_RANGE(c2, -255, 255) / 255.f;
+
+    // as in gammaLut
+    gamma = ga / 10.0;
+    if ( gamma<0.1) gamma = -0.1;
+    if ( gamma> 5.0) gamma = 5.0;
+
+    post0 = offset[0] == 0 && offset[1] == 0 && offset[2] == 0 && gamma == 1.0f;
+}
+
+float ToneCurve::pre(float x) const
+{
+    double y = (x - 0.5 * (1 - B)) * k + 0.5 * (1 + B);
+    return (float)CLIP_RANGE(y, 0.0, 1.0);
+}
+
+float ToneCurve::post(float x, int c) const
+{
+    float y = CLIP_RANGE(x + offset[c], 0.f, 1.f);
+    return std::min(std::pow(y, gamma), 1.f);
+}
+
+void ToneCurve::applyPre(Mat& img) const
+{
+    img.convertTo(img, -1, k, 0.5 * (1 + B) - 0.5 * (1 - B) * k);
+    max(img, Scalar::all(0), img);
+    min(img, Scalar::all(1), img);
+}
+
+void ToneCurve::applyPost(Mat& img) const
+{
+    add(img, Scalar(offset[0], offset[1], offset[2]), img);
+    max(img, Scalar::all(0), img);
+    min(img, Scalar::all(1), img);
+    if (gamma != 1.0f)
+    {
+        // 0 to a negative power is inf, which the clamp turns into 1
+        pow(img, gamma, img);
+        min(img, Scalar::all(1), img);
+    }
+}
+
+void ToneCurve::preTable(vector<ushort>& table) const
+{
+    table.resize(65536);
+    for (int i = 0; i < 65536; i++)
+        table[i] = saturate_cast<ushort>(pre(i / 65535.f) * 65535.f);
+}
+
+void ToneCurve::postTable(vector<ushort>& table) const
+{
+    table.resize(65536*3);
+    for (int i = 0; i < 65536; i++)
+    {
+        for (int c = 0; c < 3; c++)
+            table[i*3+c] = saturate_cast<ushort>(post(i / 65535.f, c) * 65535.f);
+    }
+}
+
+/**
+ * ToneCurve applied to one sample type
+ *
+ * pre(in, out) runs brightness/contrast, out may be the same Mat as in;
+ * post(img) runs colour balance and gamma in place. 16-bit images go
+ * through 65536-entry tables built once per DeepTone, float images through
+ * ToneCurve::applyPre/applyPost.
+ */
+template<typename T> class DeepTone;
+
+template<>
+class DeepTone<ushort>
+{
+public:
+    explicit DeepTone(const ToneCurve& curve)
+        : skipPre(curve.preIdentity()), skipPost(curve.postIdentity())
+    {
+        if (!skipPre)
+            curve.preTable(preLut);
+        if (!skipPost)
+            curve.postTable(postLut);
+    }
+
+    void pre(const Mat& in, Mat& out) const
+    {
+        if (skipPre)
+        {
+            if (out.data != in.data)
+                in.copyTo(out);
+            return;
+        }
+        lookup(in, out, &preLut[0], 1);
+    }
+
+    void post(Mat& img) const
+    {
+        if (!skipPost)
+            lookup(img, img, &postLut[0], 3);
+    }
+
+private:
+    static void lookup(const Mat& in, Mat& out, const ushort* lut, int cn)
+    {
+        for (int i = 0; i < in.rows; i++)
+        {
+            const ushort* p = in.ptr<ushort>(i);
+            ushort* q = out.ptr<ushort>(i);
+            for (int j = 0; j < in.cols*3; j += 3)
+            {
+                q[j] = lut[p[j]*cn];
+                q[j+1] = lut[p[j+1]*cn + (cn == 3 ? 1 : 0)];
+                q[j+2] = lut[p[j+2]*cn + (cn == 3 ? 2 : 0)];
+            }
+        }
+    }
+
+    bool skipPre, skipPost;
+    vector<ushort> preLut, postLut;
+};
+
+template<>
+class DeepTone<float>
+{
+public:
+    explicit DeepTone(const ToneCurve& curve) : curve(curve) {}
+
+    void pre(const Mat& in, Mat& out) const
+    {
+        if (out.data != in.data)
+            in.copyTo(out);
+        if (!curve.preIdentity())
+            curve.applyPre(out);
+    }
+
+    void post(Mat& img) const
+    {
+        if (!curve.postIdentity())
+            curve.applyPost(img);
+    }
+
+private:
+    const ToneCurve& curve;
+};
+
+
+// float Lab has L in [0, 100] and a, b in about [-128, 127], 8-bit Lab
+// stores L * 255/100 and a + 128, b + 128
+DeepShift labShift(int l, int a, int b)
+{
+    DeepShift s;
+    s.toCode = CV_BGR2Lab;
+    s.fromCode = CV_Lab2BGR;
+    s.d[0] = CLIP_RANGE(l, -255, 255) * 100.f / 255.f;
+    s.d[1] = (float)CLIP_RANGE(a, -255, 255);
+    s.d[2] = (float)CLIP_RANGE(b, -255, 255);
+    s.lo[0] = 0;    s.lo[1] = -128; s.lo[2] = -128;
+    s.hi[0] = 100;  s.hi[1] = 127;  s.hi[2] = 127;
+    return s;
+}
+
+// float HSV has H in [0, 360] and S, V in [0, 1], 8-bit HSV stores H / 2
+DeepShift hsvShift(int hue, int saturation, int ilumination)
+{
+    DeepShift s;
+    s.toCode = CV_BGR2HSV;
+    s.fromCode = CV_HSV2BGR;
+    s.d[0] = CLIP_RANGE(hue, -180, 180) * 2.f;
+    s.d[1] = CLIP_RANGE(saturation, -255, 255) / 255.f;
+    s.d[2] = CLIP_RANGE(ilumination, -255, 255) / 255.f;
+    s.lo[0] = 0;    s.lo[1] = 0;    s.lo[2] = 0;
+    s.hi[0] = 360;  s.hi[1] = 1;    s.hi[2] = 1;
+    return s;
+}
+
+// shiftColorSpace for 16-bit and float images, each strip is converted to
+// a float strip in scratch, shifted there and converted back into out
+template<typename T>
+static void shiftDeep(const Mat& in, Mat& out, const DeepShift& shift, Mat& scratch)
+{
+    double scale = SampleRange<T>::scale();
+    int strip = stripRows(in);
+    for (int y = 0; y < in.rows; y += strip)
+    {
+        int yEnd = std::min(y + strip, in.rows);
+        Mat dstStrip = out.rowRange(y, yEnd);
+        Mat f = scratchView(scratch, yEnd - y, in.cols, CV_32FC3);
+        in.rowRange(y, yEnd).convertTo(f, CV_32F, 1.0 / scale);
+        cvtColor(f, f, shift.toCode);
+        add(f, Scalar(shift.d[0], shift.d[1], shift.d[2]), f);
+        max(f, Scalar(shift.lo[0], shift.lo[1], shift.lo[2]), f);
+        min(f, Scalar(shift.hi[0], shift.hi[1], shift.hi[2]), f);
+        cvtColor(f, f, shift.fromCode);
+        f.convertTo(dstStrip, out.type(), scale);
+    }
+}
+
+/**
+ * The adjustment chain on a CV_16UC3 or CV_32FC3 image
+ *
+ * Runs brightness/contrast, Lab, HSV, colour balance and gamma over bands
+ * of rows in parallel like AdjustGraph does for 8-bit images. The float
+ * round trip through Lab or HSV is close to lossless, so a shift with no
+ * offsets is skipped. dst may be the same Mat as img.
+ */
+template<typename T>
+static void adjustDeep(const Mat& img, Mat& dst, const ToneCurve& curve,
+                       const DeepShift& lab, const DeepShift& hsv, int bandBytes)
+{
+    dst.create(img.size(), img.type());
+    DeepTone<T> tone(curve);
+
+    parallelRows(img.rows, bandRows(img, bandBytes), [&](int y0, int y1) {
+        Mat tile = dst.rowRange(y0, y1);
+        PooledMat scratch(scratchPool(), stripRows(img), img.cols, CV_32FC3);
+
+        tone.pre(img.rowRange(y0, y1), tile);
+        if (!lab.isIdentity())
+            shiftDeep<T>(tile, tile, lab, scratch.mat);
+        if (!hsv.isIdentity())
+            shiftDeep<T>(tile, tile, hsv, scratch.mat);
+        tone.post(tile);
+    });
+}
+
+// adjustDeep for the depth of img, which must be CV_16UC3 or CV_32FC3
+static void adjustDeep(const Mat& img, Mat& dst, const ToneCurve& curve,
+                       const DeepShift& lab = DeepShift(), const DeepShift& hsv = DeepShift(),
+                       int bandBytes = 256*1024)
+{
+    CV_Assert(img.type() == CV_16UC3 || img.type() == CV_32FC3);
+    if (img.depth() == CV_16U)
+        adjustDeep<ushort>(img, dst, curve, lab, hsv, bandBytes);
+    else
+        adjustDeep<float>(img, dst, curve, lab, hsv, bandBytes);
+}
+
+// identity tone curve, for chains with only Lab or HSV offsets
+static ToneCurve neutralTone()
+{
+    return ToneCurve(0, 0, 0, 0, 0, 10);
+}
+  
+// Lookup table of adjustBrightnessContrast
+static void brightnessContrastLut(int brightness, int contrast, Mat& lookupTable)
+{
+    brightness = CLIP_RANGE(brightness, -255, 255);
+    contrast = CLIP_RANGE(contrast, -255, 255);
+
+    /**
+    Algorithm of Brightness Contrast transformation
+    The formula is:
+        y = [x - 127.5 * (1 - B)] * k + 127.5 * (1 + B);
+
+        x is the input pixel value
+        y is the output pixel value
+        B is brightness, value range is [-1,1]
+        k is used to adjust contrast
+            k = tan( (45 + 44 * c) / 180 * PI );
+            c is contrast, value range is [-1,1]
+    */
+
+    double B = brightness / 255.;
+    double c = contrast / 255. ;
+    double k = tan( (45 + 44 * c) / 180 * M_PI );
+
+    lookupTable.create(1, 256, CV_8U);
+    uchar *p = lookupTable.data;
+    for (int i = 0; i < 256; i++)
+        p[i] = COLOR_RANGE( (i - 127.5 * (1 - B)) * k + 127.5 * (1 + B) );
+}
+  
+/** 
+ * Adjust Brightness and Contrast 
+ * 
+ * @param src [in] InputArray 
+ * @param dst [out] OutputArray 
+ * @param brightness [in] integer, value range [-255, 255] 
+ * @param contrast [in] integer, value range [-255, 255] 
+ * 
+ * @return 0 if success, else return error code 
+ *
+ * dst is written directly and only reallocated when its size or type
+ * differ from src. It may be src itself, see the in-place variant below,
+ * but must not partly overlap it.
+ */  
+int adjustBrightnessContrast(const Mat& src, Mat& dst, int brightness, int contrast)  
+{  
+    IMGADJUST_PROFILE_SCOPE("adjustBrightnessContrast");
+    //Mat input = src.getMat();  
+    //if( input.empty() ) {  
+    //    return -1;  
+    //}  
+  
+    dst.create(src.size(), src.type());  
+    //Mat output = dst.getMat();  
+
+    if (src.depth() != CV_8U)
+    {
+        adjustDeep(src, dst, ToneCurve(brightness, contrast, 0, 0, 0, 10));
+        return 0;
+    }
+  
+    Mat lookupTable;
+    brightnessContrastLut(brightness, contrast, lookupTable);
+  
+    parallelLut(src, lookupTable, dst);
+  
+    return 0;  
+}  
+
+// In place: a lookup per value, no temporary at all
+int adjustBrightnessContrast(Mat& img, int brightness, int contrast)
+{
+    return adjustBrightnessContrast(img, img, brightness, contrast);
+}  
+
+// Add per-channel offsets to a 3-channel 8-bit image in place,
+// channel 0 is clamped to [0, max0] and the others to [0, 255]
+static void offsetChannels(Mat& img, int d0, int d1, int d2, int max0)
+{
+    int i, j;
+    Size size = img.size();
+    int chns = img.channels();
+    CV_Assert(img.depth() == CV_8U && chns == 3);
+
+    if (img.isContinuous())
+    {
+        size.width *= size.height;
+        size.height = 1;
+    }
+
+#if CV_SIMD128
+    // a signed offset is a saturating add of its positive part followed by a
+    // saturating subtract of its negative part, 16 pixels per step
+    bool simd = useOptimized();
+    v_uint8x16 add0 = v_setall_u8((uchar)std::max(d0, 0)), sub0 = v_setall_u8((uchar)std::max(-d0, 0));
+    v_uint8x16 add1 = v_setall_u8((uchar)std::max(d1, 0)), sub1 = v_setall_u8((uchar)std::max(-d1, 0));
+    v_uint8x16 add2 = v_setall_u8((uchar)std::max(d2, 0)), sub2 = v_setall_u8((uchar)std::max(-d2, 0));
+    v_uint8x16 top0 = v_setall_u8((uchar)max0);
+#endif
+
+    for (  i= 0; i<size.height; ++i)
+    {
+        unsigned char* src = (unsigned char*)img.data+img.step*i;
+        j = 0;
+#if CV_SIMD128
+        if (simd)
+        {
+            for ( ; j <= size.width - 16; j += 16)
+            {
+                v_uint8x16 c0, c1, c2;
+                v_load_deinterleave(src + j*3, c0, c1, c2);
+                c0 = v_min((c0 + add0) - sub0, top0);
+                c1 = (c1 + add1) - sub1;
+                c2 = (c2 + add2) - sub2;
+                v_store_interleave(src + j*3, c0, c1, c2);
+            }
+        }
+#endif
+        for ( ; j<size.width; ++j)
+        {
+            src[j*chns] = CLIP_RANGE(src[j*chns]+d0, 0, max0);
+            src[j*chns+1] = COLOR_RANGE(src[j*chns+1]+d1);
+            src[j*chns+2] = COLOR_RANGE(src[j*chns+2]+d2);
+        }
+    }
+}  
+
+/**
+ * Shift colours in another colour space without a frame-sized intermediate
+ *
+ * Converts a strip of about 32 KB of `in` with toCode, adds the offsets and
+ * converts it back into `out` with fromCode, strip by strip, so the
+ * converted pixels are still in L1 when they are shifted and converted back.
+ * scratch holds one strip (stripRows rows) and can be reused between calls.
+ * out must have the size and type of in and may be the same Mat.
+ */
+static void shiftColorSpace(const Mat& in, Mat& out, int toCode, int fromCode,
+                            int d0, int d1, int d2, int max0, Mat& scratch)
+{
+    int strip = stripRows(in);
+    for (int y = 0; y < in.rows; y += strip)
+    {
+        int yEnd = std::min(y + strip, in.rows);
+        Mat dstStrip = out.rowRange(y, yEnd);
+        Mat conv = scratchView(scratch, yEnd - y, in.cols, in.type());
+        cvtColor(in.rowRange(y, yEnd), conv, toCode);
+        offsetChannels(conv, d0, d1, d2, max0);
+        cvtColor(conv, dstStrip, fromCode);
+    }
+}
+
+// L:0~255, A:0~255, B:0~255  
+// aImg is written strip by strip through a strip-sized scratch buffer and
+// only reallocated when its size or type differ from img; it may be img
+// itself but must not partly overlap it
+void AdjustLAB(const Mat& img, Mat& aImg, int  l, int a, int b)  
+{  
+    IMGADJUST_PROFILE_SCOPE("AdjustLAB");
+    aImg.create(img.rows, img.cols, img.type());
+  
+    // ֤Χ  
+    if ( l<-255 )  
+        l = -255;  
+  
+    if ( a<-255)  
+        a = -255;  
+  
+    if ( b<-255 )  
+        b = -255;  
+  
+    if ( l>255)  
+        l = 255;  
+  
+    if ( a>255)  
+        a = 255;  
+  
+    if ( b>255)  
+        b = 255;  
+  
+    if (img.depth() != CV_8U)
+    {
+        adjustDeep(img, aImg, neutralTone(), labShift(l, a, b));
+        return;
+    }
+  
+    parallelRows(img.rows, bandRows(img), [&](int y0, int y1) {
+        PooledMat scratch(scratchPool(), stripRows(img), img.cols, img.type());
+        Mat out = aImg.rowRange(y0, y1);
+        shiftColorSpace(img.rowRange(y0, y1), out, CV_BGR2Lab, CV_Lab2BGR, l, a, b, 255, scratch.mat);
+    });
+}  
+
+// In place: each strip is converted out and written back over itself
+void AdjustLAB(Mat& img, int l, int a, int b)
+{
+    AdjustLAB(img, img, l, a, b);
+}
+
+// H:0~180, S:0~255, V:0~255  
+// aImg as in AdjustLAB
+void AdjustHSI(const Mat& img, Mat& aImg, int  hue, int saturation, int ilumination)  
+{  
+    IMGADJUST_PROFILE_SCOPE("AdjustHSI");
+    aImg.create(img.rows, img.cols, img.type());
+  
+    // ֤Χ  
+    if ( hue<-180 )  
+        hue = -180;  
+  
+    if ( saturation<-255)  
+        saturation = -255;  
+  
+    if ( ilumination<-255 )  
+        ilumination = -255;  
+  
+    if ( hue>180)  
+        hue = 180;  
+  
+    if ( saturation>255)  
+        saturation = 255;  
+  
+    if ( ilumination>255)  
+        ilumination = 255;  
+  
+    if (img.depth() != CV_8U)
+    {
+        adjustDeep(img, aImg, neutralTone(), DeepShift(), hsvShift(hue, saturation, ilumination));
+        return;
+    }
+  
+    parallelRows(img.rows, bandRows(img), [&](int y0, int y1) {
+        PooledMat scratch(scratchPool(), stripRows(img), img.cols, img.type());
+        Mat out = aImg.rowRange(y0, y1);
+        shiftColorSpace(img.rowRange(y0, y1), out, CV_BGR2HSV, CV_HSV2BGR,
+                        hue, saturation, ilumination, 180, scratch.mat);
+    });
+}  
+
+// In place: each strip is converted out and written back over itself
+void AdjustHSI(Mat& img, int hue, int saturation, int ilumination)
+{
+    AdjustHSI(img, img, hue, saturation, ilumination);
+}
+
+// Lookup table of ColorBalance, one 256-entry table per channel interleaved
+// like a CV_8UC3 row, offsets already clipped to [-255, 255]
+static void colorBalanceLut(int c0, int c1, int c2, unsigned char* lut)
+{
+    for (int i = 0; i < 256; i++)
+    {
+        lut[i*3] = saturate_cast<uchar>(i + c0);
+        lut[i*3+1] = saturate_cast<uchar>(i + c1);
+        lut[i*3+2] = saturate_cast<uchar>(i + c2);
+    }
+}
+
+// cbImg is written directly and only reallocated when its size or type
+// differ from img; it may be img itself but must not partly overlap it
+void ColorBalance(const Mat& img, Mat& cbImg, int cR, int cG, int cB)  
+{  
+    IMGADJUST_PROFILE_SCOPE("ColorBalance");
+    if ( cbImg.empty())   
+        cbImg.create(img.rows, img.cols, img.type());    
+  
+    //cbImg = cv::Scalar::all(0);  
+    
+    // ֤Χ  
+    if ( cR<-255 )   
+        cR = -255;  
+  
+    if ( cG<-255 )   
+        cG = -255;  
+  
+    if ( cB<-255 )   
+        cB = -255;  
+  
+    if ( cR>255)  
+        cR = 255;  
+  
+    if ( cG>255)  
+        cG = 255;  
+  
+    if ( cB>255)  
+        cB = 255;  
+  
+  
+    if (img.depth() != CV_8U)
+    {
+        adjustDeep(img, cbImg, ToneCurve(0, 0, cR, cG, cB, 10));
+        return;
+    }
+
+    Mat lookupTable(1, 256, CV_8UC3);
+    colorBalanceLut(cR, cG, cB, lookupTable.data);
+
+    parallelLut(img, lookupTable, cbImg);
+}  
+
+// In place: a lookup per value, no temporary at all
+void ColorBalance(Mat& img, int cR, int cG, int cB)
+{
+    ColorBalance(img, img, cR, cG, cB);
+}
+
+// Lookup table of GammaCorrect, ga is in tenths as on the trackbar
+static void gammaLut(float ga, unsigned char* lut)
+{
+    ga = ga / 10.0;
+    if ( ga<0.1) ga = -0.1;
+    if ( ga> 5.0) ga = 5.0;
+
+    for( int i = 0; i < 256; i++ )
+    {
+        lut[i] = saturate_cast<uchar>(cv::pow((float)(i/255.0), ga) * 255.0f);
+    }
+}
+
+// Gamma [0.1, 5.0]  
+// cImg as in ColorBalance
+void GammaCorrect(const Mat& img, Mat& cImg, float ga)  
+{  
+    IMGADJUST_PROFILE_SCOPE("GammaCorrect");
+    if ( cImg.empty())    
+        cImg.create(img.rows, img.cols, img.type());          
+  
+    //cImg = cv::Scalar::all(0);  
+
+    if (img.depth() != CV_8U)
+    {
+        adjustDeep(img, cImg, ToneCurve(0, 0, 0, 0, 0, ga));
+        return;
+    }
+  
+    // ٣ұ  
+    Mat lookupTable(1, 256, CV_8U);
+    gammaLut(ga, lookupTable.data);
+  
+    parallelLut(img, lookupTable, cImg);
+}
+
+// In place: a lookup per value, no temporary at all
+void GammaCorrect(Mat& img, float ga)
+{
+    GammaCorrect(img, img, ga);
+}
+
+
+ChannelLut::ChannelLut()
+{
+    for (int i = 0; i < 256; i++)
+        table[i*3] = table[i*3+1] = table[i*3+2] = (uchar)i;
+}
+
+ChannelLut& ChannelLut::then(const Mat& next)
+{
+    CV_Assert(next.total() == 256 && next.depth() == CV_8U &&
+              (next.channels() == 1 || next.channels() == 3));
+
+    int cn = next.channels();
+    const uchar* n = next.ptr<uchar>();
+    for (int i = 0; i < 256*3; i++)
+        table[i] = n[table[i]*cn + (cn == 3 ? i % 3 : 0)];
+
+    return *this;
+}
+
+bool ChannelLut::isIdentity() const
+{
+    for (int i = 0; i < 256*3; i++)
+    {  
+        if (table[i] != i / 3)
+            return false;
+    }  
+    return true;
+}
+  
+void ChannelLut::apply(const Mat& img, Mat& dst) const
+{
+    parallelLut(img, Mat(1, 256, CV_8UC3, (void*)table), dst);
+}
+
+
+// Blend weights of a region: 255 where the adjusted image is used, 0 where
+// the original is kept, with a box-filtered ramp of `feather` pixels at the
+// edge. mask is the CV_8UC1 output of getMask.
+void regionWeight(const Mat& mask, int region, int feather, Mat& weight)
+{
+    IMGADJUST_PROFILE_SCOPE("regionWeight");
+    if (region == REGION_OUTSIDE)
+        bitwise_not(mask, weight);
+    else
+        mask.copyTo(weight);
+
+    if (feather > 0)
+        blur(weight, weight, Size(2*feather + 1, 2*feather + 1));
+}
+
+// blendRegion rows [y0, y1) of 16-bit and float images
+template<typename T>
+static void blendRows(const Mat& img, const Mat& adjusted, const Mat& weight, Mat& dst, int y0, int y1)
+{
+    for (int i = y0; i < y1; i++)
+    {
+        const T* p = img.ptr<T>(i);
+        const T* q = adjusted.ptr<T>(i);
+        const uchar* w = weight.ptr<uchar>(i);
+        T* out = dst.ptr<T>(i);
+        for (int j = 0; j < img.cols; j++)
+        {
+            float wa = w[j] / 255.f;
+            for (int c = 0; c < 3; c++)
+                out[j*3+c] = saturate_cast<T>(p[j*3+c] + (q[j*3+c] - (float)p[j*3+c]) * wa);
+        }
+    }
+}
+
+template<>
+void blendRows<uchar>(const Mat& img, const Mat& adjusted, const Mat& weight, Mat& dst, int y0, int y1)
+{
+    for (int i = y0; i < y1; i++)
+    {
+        const uchar* p = img.ptr<uchar>(i);
+        const uchar* q = adjusted.ptr<uchar>(i);
+        const uchar* w = weight.ptr<uchar>(i);
+        uchar* out = dst.ptr<uchar>(i);
+        for (int j = 0; j < img.cols; j++)
+        {
+            int wa = w[j], wi = 255 - w[j];
+            out[j*3] = (uchar)((q[j*3]*wa + p[j*3]*wi + 127) / 255);
+            out[j*3+1] = (uchar)((q[j*3+1]*wa + p[j*3+1]*wi + 127) / 255);
+            out[j*3+2] = (uchar)((q[j*3+2]*wa + p[j*3+2]*wi + 127) / 255);
+        }
+    }
+}
+
+// dst = (adjusted * weight + img * (255 - weight)) / 255 per channel,
+// dst may be the same Mat as img or adjusted
+void blendRegion(const Mat& img, const Mat& adjusted, const Mat& weight, Mat& dst)
+{
+    IMGADJUST_PROFILE_SCOPE("blendRegion");
+    CV_Assert((img.type() == CV_8UC3 || img.type() == CV_16UC3 || img.type() == CV_32FC3) &&
+              adjusted.type() == img.type() && adjusted.size() == img.size() &&
+              weight.type() == CV_8UC1 && weight.size() == img.size());
+    dst.create(img.size(), img.type());
+
+    parallelRows(img.rows, bandRows(img), [&](int y0, int y1) {
+        if (img.depth() == CV_16U)
+            blendRows<ushort>(img, adjusted, weight, dst, y0, y1);
+        else if (img.depth() == CV_32F)
+            blendRows<float>(img, adjusted, weight, dst, y0, y1);
+        else
+            blendRows<uchar>(img, adjusted, weight, dst, y0, y1);
+    });
+}
+
+
+AdjustGraph::AdjustGraph(const AdjustParams& p, int tileBytes)
+    : tileBytes(tileBytes),
+      // channel order is BGR, so blue is the first offset
+      curve(p.brightness, p.contrast, p.cB, p.cG, p.cR, p.ga),
+      lab(labShift(p.l, p.a, p.b)),
+      hsv(hsvShift(p.hue, p.saturation, p.ilumination))
+{
+    Mat lut;
+    brightnessContrastLut(p.brightness, p.contrast, lut);
+    addLut(lut);
+
+    addShift(STAGE_LAB, CLIP_RANGE(p.l, -255, 255),
+             CLIP_RANGE(p.a, -255, 255), CLIP_RANGE(p.b, -255, 255));
+    addShift(STAGE_HSV, CLIP_RANGE(p.hue, -180, 180),
+             CLIP_RANGE(p.saturation, -255, 255), CLIP_RANGE(p.ilumination, -255, 255));
+
+    // channel order is BGR, so blue is the first table
+    lut.create(1, 256, CV_8UC3);
+    colorBalanceLut(CLIP_RANGE(p.cB, -255, 255), CLIP_RANGE(p.cG, -255, 255),
+                    CLIP_RANGE(p.cR, -255, 255), lut.data);
+    addLut(lut);
+
+    lut.create(1, 256, CV_8U);
+    gammaLut(p.ga, lut.data);
+    addLut(lut);
+
+    // the first stage also copies img into dst, so only later ones can go
+    for (size_t i = stages.size() - 1; i > 0; i--)
+    {
+        if (stages[i].kind == STAGE_LUT && stages[i].lut.isIdentity())
+            stages.erase(stages.begin() + i);
+    }
+}
+
+void AdjustGraph::addLut(const Mat& lut)
+{
+    if (stages.empty() || stages.back().kind != STAGE_LUT)
+    {
+        Stage stage;
+        stage.kind = STAGE_LUT;
+        stage.d0 = stage.d1 = stage.d2 = 0;
+        stages.push_back(stage);
+    }
+    stages.back().lut.then(lut);
+}
+
+void AdjustGraph::addShift(StageKind kind, int d0, int d1, int d2)
+{
+    Stage stage;
+    stage.kind = kind;
+    stage.d0 = d0;
+    stage.d1 = d1;
+    stage.d2 = d2;
+    stages.push_back(stage);
+}
+
+void AdjustGraph::run(const Mat& img, Mat& dst) const
+{
+    IMGADJUST_PROFILE_SCOPE("AdjustGraph::run");
+    if (img.depth() != CV_8U)
+    {
+        adjustDeep(img, dst, curve, lab, hsv, tileBytes);
+        return;
+    }
+    dst.create(img.size(), img.type());
+
+    parallelRows(img.rows, bandRows(img, tileBytes), [&](int y0, int y1) {
+        Mat tile = dst.rowRange(y0, y1);
+        PooledMat scratch(scratchPool(), stripRows(img), img.cols, img.type());
+        runStages(img.rowRange(y0, y1), tile, scratch.mat);
+    });
+}
+
+void AdjustGraph::runMasked(const Mat& img, Mat& dst, const Mat& weight, int tileSize) const
+{
+    IMGADJUST_PROFILE_SCOPE("AdjustGraph::runMasked");
+    CV_Assert(weight.type() == CV_8UC1 && weight.size() == img.size() && tileSize > 0);
+    if (img.depth() != CV_8U)
+    {
+        // 16-bit and float images are adjusted whole, then blended
+        PooledMat adjusted(scratchPool(), img.rows, img.cols, img.type());
+        run(img, adjusted.mat);
+        blendRegion(img, adjusted.mat, weight, dst);
+        return;
+    }
+    dst.create(img.size(), img.type());
+
+    parallelRows(img.rows, tileSize, [&](int y0, int y1) {
+        PooledMat scratch(scratchPool(), tileSize, tileSize, img.type());
+        PooledMat adjusted(scratchPool(), tileSize, tileSize, img.type());
+        for (int x0 = 0; x0 < img.cols; x0 += tileSize)
+        {
+            Rect r(x0, y0, std::min(tileSize, img.cols - x0), y1 - y0);
+            Mat in = img(r);
+            Mat out = dst(r);
+            Mat w = weight(r);
+
+            double lo, hi;
+            minMaxLoc(w, &lo, &hi);
+            if (hi == 0)
+            {
+                if (out.data != in.data)
+                    in.copyTo(out);
+            }
+            else if (lo == 255)
+                runStages(in, out, scratch.mat);
+            else
+            {
+                Mat adj = scratchView(adjusted.mat, r.height, r.width, img.type());
+                runStages(in, adj, scratch.mat);
+                blendRegion(in, adj, w, out);
+            }
+        }
+    });
+}
+
+// all stages over one tile, the first one also copies in to out
+void AdjustGraph::runStages(const Mat& in, Mat& out, Mat& scratch) const
+{
+    out.create(in.size(), in.type());
+    for (size_t i = 0; i < stages.size(); i++)
+        runStage(stages[i], i == 0 ? in : out, out, scratch);
+}
+
+void AdjustGraph::runStage(const Stage& stage, const Mat& in, Mat& out, Mat& scratch) const
+{
+    // one event per band and stage, on the thread that ran it
+    IMGADJUST_PROFILE_SCOPE(stage.kind == STAGE_LUT ? "graph lut" : stage.kind == STAGE_LAB ? "graph lab" : "graph hsv");
+    switch (stage.kind)
+    {
+    case STAGE_LUT:
+        stage.lut.apply(in, out);
+        break;
+    case STAGE_LAB:
+        shiftColorSpace(in, out, CV_BGR2Lab, CV_Lab2BGR, stage.d0, stage.d1, stage.d2, 255, scratch);
+        break;
+    case STAGE_HSV:
+        shiftColorSpace(in, out, CV_BGR2HSV, CV_HSV2BGR, stage.d0, stage.d1, stage.d2, 180, scratch);
+        break;
+    }
+} 
+
+
+ColorCube::ColorCube()
+    : n(0)
+{}
+
+void ColorCube::bake(const AdjustGraph& graph, int size)
+{
+    CV_Assert(size >= 2 && size <= 256);
+
+    // lattice row (b*n + g) holds red 0..n-1, the chain only takes 8-bit
+    // colours so points between two levels are rounded to the nearest one
+    Mat points(size*size, size, CV_8UC3);
+    for (int b = 0; b < size; b++)
+    {
+        for (int g = 0; g < size; g++)
+        {
+            uchar* p = points.ptr<uchar>(b*size + g);
+            for (int r = 0; r < size; r++)
+            {
+                p[r*3] = saturate_cast<uchar>(b * 255.0 / (size - 1));
+                p[r*3+1] = saturate_cast<uchar>(g * 255.0 / (size - 1));
+                p[r*3+2] = saturate_cast<uchar>(r * 255.0 / (size - 1));
+            }
+        }
+    }
+
+    Mat out;
+    graph.run(points, out);
+
+    n = size;
+    lattice.resize((size_t)size*size*size*3);
+    for (int i = 0; i < size*size; i++)
+    {
+        const uchar* p = out.ptr<uchar>(i);
+        for (int j = 0; j < size*3; j++)
+            lattice[(size_t)i*size*3 + j] = p[j];
+    }
+}
+
+// Interpolation inside one lattice cell: c000 is its first corner, d* the
+// offsets to the next point along each axis and f* the position in it
+struct CubeTrilinear
+{
+    float operator()(const float* c000, int dr, int dg, int db,
+                     float fr, float fg, float fb, int c) const
+    {
+        const float* c111 = c000 + db + dg + dr;
+        float c00 = c000[c]*(1-fr) + c000[dr+c]*fr;
+        float c01 = c000[dg+c]*(1-fr) + c000[dg+dr+c]*fr;
+        float c10 = c000[db+c]*(1-fr) + c000[db+dr+c]*fr;
+        float c11 = c000[db+dg+c]*(1-fr) + c111[c]*fr;
+        return (c00*(1-fg) + c01*fg)*(1-fb) + (c10*(1-fg) + c11*fg)*fb;
+    }
+};
+
+struct CubeTetrahedral
+{
+    float operator()(const float* c000, int dr, int dg, int db,
+                     float fr, float fg, float fb, int c) const
+    {
+        // pick the one of six tetrahedra holding the point
+        const float* c111 = c000 + db + dg + dr;
+        if (fr > fg)
+        {
+            if (fg > fb)
+                return (1-fr)*c000[c] + (fr-fg)*c000[dr+c] + (fg-fb)*c000[dr+dg+c] + fb*c111[c];
+            if (fr > fb)
+                return (1-fr)*c000[c] + (fr-fb)*c000[dr+c] + (fb-fg)*c000[dr+db+c] + fg*c111[c];
+            return (1-fb)*c000[c] + (fb-fr)*c000[db+c] + (fr-fg)*c000[dr+db+c] + fg*c111[c];
+        }
+        if (fb > fg)
+            return (1-fb)*c000[c] + (fb-fg)*c000[db+c] + (fg-fr)*c000[dg+db+c] + fr*c111[c];
+        if (fb > fr)
+            return (1-fg)*c000[c] + (fg-fb)*c000[dg+c] + (fb-fr)*c000[dg+db+c] + fr*c111[c];
+        return (1-fg)*c000[c] + (fg-fr)*c000[dg+c] + (fr-fb)*c000[dr+dg+c] + fb*c111[c];
+    }
+};
+
+// One pass of ColorCube::apply with the interpolation fixed, so the choice
+// is made once per image instead of once per pixel; bands of rows run on
+// all threads
+template<typename Interp>
+static void cubeApply(const Mat& img, Mat& dst, const float* lat, int n, Interp interp)
+{
+    // lattice cell and position inside it for every 8-bit level
+    int idx[256];
+    float frac[256];
+    for (int v = 0; v < 256; v++)
+    {
+        float x = v * (n - 1) / 255.0f;
+        idx[v] = std::min((int)x, n - 2);
+        frac[v] = x - idx[v];
+    }
+
+    const int dr = 3, dg = n*3, db = n*n*3;
+
+    parallelRows(img.rows, bandRows(img), [&](int y0, int y1) {
+        for (int i = y0; i < y1; i++)
+        {
+            const uchar* src = img.ptr<uchar>(i);
+            uchar* out = dst.ptr<uchar>(i);
+            for (int j = 0; j < img.cols; j++)
+            {
+                int vb = src[j*3], vg = src[j*3+1], vr = src[j*3+2];
+                float fb = frac[vb], fg = frac[vg], fr = frac[vr];
+                const float* c000 = lat + idx[vb]*db + idx[vg]*dg + idx[vr]*dr;
+
+                for (int c = 0; c < 3; c++)
+                    out[j*3+c] = saturate_cast<uchar>(interp(c000, dr, dg, db, fr, fg, fb, c));
+            }
+        }
+    });
+}
+
+void ColorCube::apply(const Mat& img, Mat& dst, int interpolation) const
+{
+    CV_Assert(n >= 2 && img.type() == CV_8UC3);
+
+    dst.create(img.size(), img.type());
+
+    if (interpolation == CUBE_TRILINEAR)
+        cubeApply(img, dst, &lattice[0], n, CubeTrilinear());
+    else
+        cubeApply(img, dst, &lattice[0], n, CubeTetrahedral());
+}
+
+bool ColorCube::load(const string& filename)
+{
+    ifstream in(filename.c_str());
+    if (!in)
+        return false;
+
+    int size = 0;
+    float domainMin[3] = { 0, 0, 0 };
+    float domainMax[3] = { 1, 1, 1 };
+    vector<float> values;
+    string line;
+    while (getline(in, line))
+    {
+        stringstream ss(line);
+        string key;
+        if (!(ss >> key) || key[0] == '#' || key == "TITLE")
+            continue;
+
+        if (key == "LUT_3D_SIZE")
+            ss >> size;
+        else if (key == "DOMAIN_MIN")
+            ss >> domainMin[0] >> domainMin[1] >> domainMin[2];
+        else if (key == "DOMAIN_MAX")
+            ss >> domainMax[0] >> domainMax[1] >> domainMax[2];
+        else if (key == "LUT_1D_SIZE" || key == "LUT_3D_INPUT_RANGE")
+            return false;
+        else
+        {
+            // data line "R G B"
+            float rgb[3];
+            stringstream data(line);
+            if (!(data >> rgb[0] >> rgb[1] >> rgb[2]))
+                return false;
+            // an empty domain would divide by zero below
+            for (int c = 0; c < 3; c++)
+            {
+                if (domainMax[c] == domainMin[c])
+                    return false;
+            }
+            for (int c = 2; c >= 0; c--)
+                values.push_back((rgb[c] - domainMin[c]) / (domainMax[c] - domainMin[c]) * 255.0f);
+        }
+    }
+
+    if (size < 2 || size > 256 || values.size() != (size_t)size*size*size*3)
+        return false;
+
+    n = size;
+    lattice.swap(values);
+    return true;
+}
+
+bool ColorCube::save(const string& filename, const string& title) const
+{
+    if (n == 0)
+        return false;
+
+    ofstream out(filename.c_str());
+    if (!out)
+        return false;
+
+    out << "TITLE \"" << title << "\"" << endl;
+    out << "LUT_3D_SIZE " << n << endl;
+    out << fixed;
+    out.precision(6);
+    for (size_t i = 0; i < lattice.size(); i += 3)
+        out << lattice[i+2] / 255.0f << " " << lattice[i+1] / 255.0f << " " << lattice[i] / 255.0f << endl;
+
+    return (bool)out;
+}
+
+
+void AdjustCache::render(const Mat& img, const AdjustParams& p, Mat& dst)
+{
+    if (img.data != srcData || img.size() != srcSize)
+    {
+        srcData = img.data;
+        srcSize = img.size();
+        done = 0;
+    }
+
+    // first stage whose parameters changed
+    int first = done;
+    if (first > 2 && (p.hue != last.hue || p.saturation != last.saturation || p.ilumination != last.ilumination))
+        first = 2;
+    if (first > 1 && (p.l != last.l || p.a != last.a || p.b != last.b))
+        first = 1;
+    if (first > 0 && (p.brightness != last.brightness || p.contrast != last.contrast))
+        first = 0;
+
+    if (first <= 0)
+        adjustBrightnessContrast(img, bc, p.brightness, p.contrast);
+    if (first <= 1)
+        AdjustLAB(bc, lab, p.l, p.a, p.b);
+    if (first <= 2)
+        AdjustHSI(lab, hsv, p.hue, p.saturation, p.ilumination);
+    done = 3;
+    last = p;
+
+    // channel order is BGR, so blue is the first table
+    Mat lut(1, 256, CV_8UC3);
+    colorBalanceLut(CLIP_RANGE(p.cB, -255, 255), CLIP_RANGE(p.cG, -255, 255),
+                    CLIP_RANGE(p.cR, -255, 255), lut.data);
+    ChannelLut tail;
+    tail.then(lut);
+
+    lut.create(1, 256, CV_8U);
+    gammaLut(p.ga, lut.data);
+    tail.then(lut);
+
+    IMGADJUST_PROFILE_SCOPE("ColorBalance+GammaCorrect");
+    tail.apply(hsv, dst);
+}
+
+/**
+ * Skin/red region of a BGR image
+ *
+ * A pixel is inside when it is not near white (some channel below 200) and
+ * its hue is below 30 or above 160. mask becomes CV_8UC1, 255 inside and 0
+ * outside, which cv::mean, copyTo and countNonZero take as is. The HSV
+ * conversion runs strip by strip in parallel bands, so no frame-sized HSV
+ * copy is allocated.
+ *
+ * @return 0 if success
+ */
+int getMask(const Mat& img, Mat& mask)
+{
+    IMGADJUST_PROFILE_SCOPE("getMask");
+    CV_Assert(img.type() == CV_8UC3);
+    mask.create(img.size(), CV_8UC1);
+
+    parallelRows(img.rows, bandRows(img), [&](int y0, int y1) {
+        int strip = stripRows(img);
+        PooledMat hsvStrip(scratchPool(), strip, img.cols, CV_8UC3);
+        for (int y = y0; y < y1; y += strip)
+        {
+            int yEnd = std::min(y + strip, y1);
+            Mat temp = scratchView(hsvStrip.mat, yEnd - y, img.cols, CV_8UC3);
+            cvtColor(img.rowRange(y, yEnd), temp, CV_BGR2HSV);
+
+            for (int i = y; i < yEnd; ++i)
+            {
+                const unsigned char* src = img.ptr<uchar>(i);
+                const unsigned char* hsv = temp.ptr<uchar>(i - y);
+                unsigned char* dst = mask.ptr<uchar>(i);
+                for (int j = 0; j < img.cols; ++j)
+                {
+                    bool inside = (src[j*3]<200 || src[j*3+1]<200 || src[j*3+2]<200) &&
+                                  (hsv[j*3]<30 || 180 - hsv[j*3]<20);
+                    dst[j] = inside ? 255 : 0;
+                }
+            }
+        }
+    });
+
+    return 0;
+}
+
+
+// Add the pixels of a block that are set in mask to s, lab and hsv are
+// scratch buffers for the conversions
+static void accumulateStats(const Mat& in, const Mat& mask, Mat& labBuf, Mat& hsvBuf, long long* s)
+{
+    Mat lab = scratchView(labBuf, in.rows, in.cols, CV_8UC3);
+    Mat hsv = scratchView(hsvBuf, in.rows, in.cols, CV_8UC3);
+    cvtColor(in, lab, CV_BGR2Lab);
+    cvtColor(in, hsv, CV_BGR2HSV);
+
+    for (int i = 0; i < in.rows; i++)
+    {
+        const uchar* m = mask.ptr<uchar>(i);
+        const uchar* p[3] = { in.ptr<uchar>(i), lab.ptr<uchar>(i), hsv.ptr<uchar>(i) };
+        for (int j = 0; j < in.cols; j++)
+        {
+            if (!m[j])
+                continue;
+
+            for (int k = 0; k < 9; k++)
+            {
+                int v = p[k / 3][j*3 + k % 3];
+                s[k] += v;
+                s[9 + k] += v * v;
+            }
+            s[18]++;
+        }
+    }
+}
+
+// Add the sums getStats works from (STATS_SUMS values) for img to total,
+// so images processed in pieces can be summed piece by piece
+void addStats(const Mat& img, const Mat& mask, int step, long long* total)
+{
+    CV_Assert(img.type() == CV_8UC3 && mask.type() == CV_8UC1 && img.size() == mask.size());
+    step = std::max(step, 1);
+
+    int band = bandRows(img);
+    int bands = (img.rows + band - 1) / band;
+    vector<long long> sums((size_t)bands * STATS_SUMS, 0);
+
+    parallelRows(img.rows, band, [&](int y0, int y1) {
+        long long* s = &sums[(size_t)(y0 / band) * STATS_SUMS];
+        int strip = stripRows(img);
+        PooledMat lab(scratchPool(), strip, img.cols, CV_8UC3);
+        PooledMat hsv(scratchPool(), strip, img.cols, CV_8UC3);
+
+        if (step == 1)
+        {
+            for (int y = y0; y < y1; y += strip)
+            {
+                int yEnd = std::min(y + strip, y1);
+                accumulateStats(img.rowRange(y, yEnd), mask.rowRange(y, yEnd), lab.mat, hsv.mat, s);
+            }
+            return;
+        }
+
+        // gather the sampled pixels of the band, the grid is fixed by the
+        // image so it does not depend on where bands start
+        int first = (y0 + step - 1) / step * step;
+        if (first >= y1)
+            return;
+        int rows = (y1 - 1 - first) / step + 1;
+        int cols = (img.cols + step - 1) / step;
+        Mat pickImg(rows, cols, CV_8UC3), pickMask(rows, cols, CV_8UC1);
+        for (int i = 0; i < rows; i++)
+        {
+            const uchar* p = img.ptr<uchar>(first + i*step);
+            const uchar* m = mask.ptr<uchar>(first + i*step);
+            uchar* pp = pickImg.ptr<uchar>(i);
+            uchar* pm = pickMask.ptr<uchar>(i);
+            for (int j = 0; j < cols; j++)
+            {
+                pp[j*3] = p[j*step*3];
+                pp[j*3+1] = p[j*step*3+1];
+                pp[j*3+2] = p[j*step*3+2];
+                pm[j] = m[j*step];
+            }
+        }
+        accumulateStats(pickImg, pickMask, lab.mat, hsv.mat, s);
+    });
+
+    for (int i = 0; i < bands; i++)
+    {
+        for (int k = 0; k < STATS_SUMS; k++)
+            total[k] += sums[(size_t)i * STATS_SUMS + k];
+    }
+
+}
+
+// Means and confidence bounds from sums collected by addStats
+AdjustStats statsFromSums(const long long* total, int step)
+{
+    AdjustStats stats;
+    stats.count = total[18];
+    double n = std::max(total[18], 1LL);
+    float mean[9], err[9];
+    for (int k = 0; k < 9; k++)
+    {
+        mean[k] = (float)(total[k] / n);
+        double var = std::max(total[9 + k] / n - mean[k] * (double)mean[k], 0.0);
+        err[k] = step == 1 ? 0.f : (float)(1.96 * sqrt(var / n));
+    }
+    for (int c = 0; c < 3; c++)
+    {
+        stats.rgb[c] = mean[2 - c];
+        stats.rgbErr[c] = err[2 - c];
+        stats.lab[c] = mean[3 + c];
+        stats.labErr[c] = err[3 + c];
+        stats.hsv[c] = mean[6 + c];
+        stats.hsvErr[c] = err[6 + c];
+    }
+    return stats;
+}
+
+/**
+ * Masked RGB, Lab and HSV means in one pass
+ *
+ * Accumulates the BGR, Lab and HSV values of img inside mask strip by
+ * strip, with bands of rows running in parallel, so no frame-sized
+ * converted copy of img is allocated.
+ * Sums are integers, so the result does not depend on the thread count.
+ *
+ * With step > 1 only every step-th pixel of every step-th row is visited,
+ * which costs about 1/step^2 of the exact pass, and the *Err fields give a
+ * 95% confidence bound of each mean. Use statsStep to pick step from a
+ * pixel budget.
+ *
+ * @param img [in] adjusted CV_8UC3 image
+ * @param mask [in] CV_8UC1 region from getMask of the unadjusted image
+ * @param step [in] sampling step, 1 for exact means
+ */
+AdjustStats getStats(const Mat& img, const Mat& mask, int step)
+{
+    IMGADJUST_PROFILE_SCOPE("getStats");
+    step = std::max(step, 1);
+    long long total[STATS_SUMS] = { 0 };
+    addStats(img, mask, step, total);
+    return statsFromSums(total, step);
+}
+
+// Sampling step for getStats that visits about `budget` pixels of img
+int statsStep(const Mat& img, double budget)
+{
+    return std::max(1, (int)sqrt(img.total() / budget));
+}
+
+}  // namespace imgadjust
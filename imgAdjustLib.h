@@ -0,0 +1,574 @@
+/**
+ * imgAdjust kernels as a library
+ *
+ * Everything a call needs is in its arguments: parameters come in explicit
+ * structs, results go into Mats owned by the caller and temporaries come
+ * from a scratch pool of the calling thread. There is no shared mutable
+ * state, so any number of threads may adjust different images at the same
+ * time without waiting for each other; the only lock a call takes is the
+ * one of its own thread's pool, which no other thread contends. Objects
+ * such as AdjustGraph and ColorCube are read-only once built and may be
+ * shared between threads; AdjustCache and MaskCache hold per-caller state
+ * and may not.
+ *
+ * Everything is in namespace imgadjust, and the library writes nothing to
+ * stdout except the opt-in profiler.
+ *
+ * Images are BGR. The adjustments take CV_8UC3, CV_16UC3 and CV_32FC3,
+ * the mask and statistics CV_8UC3 only.
+ */
+#ifndef IMGADJUST_LIB_H
+#define IMGADJUST_LIB_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include "opencv2/core.hpp"
+
+
+namespace imgadjust
+{
+
+#ifdef IMGADJUST_PROFILE
+/**
+ * Stage timings of the hot paths, built with -DIMGADJUST_PROFILE
+ *
+ * IMGADJUST_PROFILE_SCOPE("name") times the rest of the enclosing block,
+ * on any thread. Each name gets a latency histogram with 8 buckets per
+ * octave of microseconds, so p50 and p99 are within 10% however long the
+ * session runs, and every scope is also kept as an event for a Chrome
+ * trace (chrome://tracing or Perfetto) up to maxEvents. Without the define
+ * the IMGADJUST_PROFILE_* macros expand to nothing and no timer code is
+ * compiled in.
+ */
+class Profiler
+{
+public:
+    Profiler() : overlay(false), start(cv::getTickCount()) {}
+
+    void record(const char* name, int64 t0, int64 t1);
+
+    // count, p50, p99 and max of every name, to cout or as text on img
+    void report() const;
+    void draw(cv::Mat& img) const;
+
+    bool saveTrace(const std::string& filename) const;
+
+    bool overlay;   // draw() on every frame shown
+
+private:
+    enum { BUCKETS = 8*26, maxEvents = 1 << 20 };
+
+    struct Histogram
+    {
+        long long count;
+        double maxUs;
+        long long bucket[BUCKETS];
+    };
+
+    struct Event
+    {
+        const char* name;
+        int64 t0, t1;
+        int tid;
+    };
+
+    double percentile(const Histogram& h, double q) const;
+    std::vector<std::string> lines() const;
+
+    int64 start;
+    mutable std::mutex m;
+    std::map<std::string, Histogram> stats;
+    std::vector<Event> events;
+    std::map<std::thread::id, int> tids;
+};
+
+// the process-wide profiler IMGADJUST_PROFILE_SCOPE reports to
+Profiler& profiler();
+
+struct ProfileScope
+{
+    const char* name;
+    int64 t0;
+
+    explicit ProfileScope(const char* name) : name(name), t0(cv::getTickCount()) {}
+    ~ProfileScope() { profiler().record(name, t0, cv::getTickCount()); }
+};
+
+#endif
+
+
+//===== scratch buffers ====
+
+/**
+ * Reusable scratch buffers
+ *
+ * Kernels take their temporaries from a pool instead of allocating them on
+ * every call, so a long run keeps cycling through the same few buffers
+ * rather than mapping and unmapping frame-sized blocks for each image.
+ * Buffers are matched by exact size and type. Hits and misses are counted
+ * to check that the pool is large enough.
+ *
+ * The free list is bounded by count and by bytes, and a buffer that has
+ * not been taken again within maxAge acquisitions is dropped, so after the
+ * image size changes the buffers of the old size do not stay pinned.
+ */
+class MatPool
+{
+public:
+    explicit MatPool(size_t maxFree = 64, size_t maxBytes = 128 << 20, long long maxAge = 256)
+        : maxFree(maxFree), maxBytes(maxBytes), maxAge(maxAge), freeBytes(0), clock(0),
+          hitCount(0), missCount(0)
+    {}
+
+    // rows x cols buffer of type, contents are undefined
+    cv::Mat acquire(int rows, int cols, int type)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            clock++;
+            for (size_t i = freeList.size(); i-- > 0; )
+            {
+                const cv::Mat& buf = freeList[i].mat;
+                if (buf.rows == rows && buf.cols == cols && buf.type() == type)
+                {
+                    cv::Mat found = buf;
+                    drop(i);
+                    hitCount++;
+                    return found;
+                }
+                if (clock - freeList[i].stamp > maxAge)
+                    drop(i);
+            }
+        }
+        missCount++;
+        return cv::Mat(rows, cols, type);
+    }
+
+    // give a buffer back, buf is left empty
+    void release(cv::Mat& buf)
+    {
+        if (!buf.empty())
+        {
+            std::lock_guard<std::mutex> lock(m);
+            Entry entry = { buf, clock };
+            freeList.push_back(entry);
+            freeBytes += bytes(buf);
+            // the least recently released buffers go first
+            while (freeList.size() > maxFree || freeBytes > maxBytes)
+                drop(0);
+        }
+        buf.release();
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(m);
+        freeList.clear();
+        freeBytes = 0;
+    }
+
+    long long hits() const { return hitCount; }
+    long long misses() const { return missCount; }
+
+private:
+    struct Entry
+    {
+        cv::Mat mat;
+        long long stamp;   // clock when it was released
+    };
+
+    static size_t bytes(const cv::Mat& buf) { return buf.total() * buf.elemSize(); }
+
+    void drop(size_t i)
+    {
+        freeBytes -= bytes(freeList[i].mat);
+        freeList.erase(freeList.begin() + i);
+    }
+
+    size_t maxFree, maxBytes;
+    long long maxAge;
+    size_t freeBytes;
+    long long clock;   // acquisitions so far
+    std::atomic<long long> hitCount, missCount;
+    mutable std::mutex m;
+    std::vector<Entry> freeList;
+};
+
+// Buffer taken from a MatPool for the lifetime of a scope
+class PooledMat
+{
+public:
+    PooledMat(MatPool& pool, int rows, int cols, int type)
+        : mat(pool.acquire(rows, cols, type)), pool(pool)
+    {}
+
+    // empty until acquire() is called
+    explicit PooledMat(MatPool& pool) : pool(pool) {}
+
+    ~PooledMat() { pool.release(mat); }
+
+    // swap the current buffer, if any, for a rows x cols one of type
+    void acquire(int rows, int cols, int type)
+    {
+        pool.release(mat);
+        mat = pool.acquire(rows, cols, type);
+    }
+
+    cv::Mat mat;
+
+private:
+    MatPool& pool;
+
+    PooledMat(const PooledMat&);
+    PooledMat& operator=(const PooledMat&);
+};
+
+// pool of the calling thread, the kernels take their temporaries from it
+MatPool& scratchPool();
+
+
+//===== adjustments ====
+
+// Parameters of the whole callbackAdjust chain, as the offsets the
+// functions below take (all 0 and ga 10 leaves the image unchanged)
+struct AdjustParams
+{
+    int brightness, contrast;
+    int l, a, b;
+    int hue, saturation, ilumination;
+    int cR, cG, cB;
+    int ga;
+    int region;    // MaskRegion the chain is applied to
+    int feather;   // width of the blend at the region edge, in pixels
+
+    AdjustParams()
+        : brightness(0), contrast(0), l(0), a(0), b(0),
+          hue(0), saturation(0), ilumination(0),
+          cR(0), cG(0), cB(0), ga(10), region(0), feather(0)
+    {}
+};
+
+// Part of the image the adjustments apply to, relative to getMask
+enum MaskRegion { REGION_ALL, REGION_INSIDE, REGION_OUTSIDE };
+
+/**
+ * Single adjustments of the chain
+ *
+ * The output Mat is reallocated only when its size or type differ from the
+ * input, and may be the input itself; the overloads without one work in
+ * place. Offsets are in 8-bit units at every depth. Ranges are
+ * brightness, contrast, l, a, b, saturation, ilumination and the colour
+ * balance in [-255, 255], hue in [-180, 180] and ga in tenths, [1, 50].
+ */
+int adjustBrightnessContrast(const cv::Mat& src, cv::Mat& dst, int brightness, int contrast);
+int adjustBrightnessContrast(cv::Mat& img, int brightness, int contrast);
+void AdjustLAB(const cv::Mat& img, cv::Mat& aImg, int l, int a, int b);
+void AdjustLAB(cv::Mat& img, int l, int a, int b);
+void AdjustHSI(const cv::Mat& img, cv::Mat& aImg, int hue, int saturation, int ilumination);
+void AdjustHSI(cv::Mat& img, int hue, int saturation, int ilumination);
+void ColorBalance(const cv::Mat& img, cv::Mat& cbImg, int cR, int cG, int cB);
+void ColorBalance(cv::Mat& img, int cR, int cG, int cB);
+void GammaCorrect(const cv::Mat& img, cv::Mat& cImg, float ga);
+void GammaCorrect(cv::Mat& img, float ga);
+
+// blend weights of a MaskRegion from a getMask mask, and the blend itself
+void regionWeight(const cv::Mat& mask, int region, int feather, cv::Mat& weight);
+void blendRegion(const cv::Mat& img, const cv::Mat& adjusted, const cv::Mat& weight, cv::Mat& dst);
+
+/**
+ * Per-channel part of the chain for 16-bit and float images
+ *
+ * The same brightness/contrast, colour balance and gamma formulas as the
+ * 8-bit lookup tables, evaluated on values normalised to [0, 1]. Offsets
+ * stay in 8-bit units and are scaled by 1/255, so a preset gives the same
+ * look at every depth. Results are clamped to [0, 1] as 8-bit ones are
+ * clamped to [0, 255], so float images must be normalised to [0, 1]
+ * first; HDR values above 1 are clipped.
+ */
+class ToneCurve
+{
+public:
+    // c0, c1, c2 are the colour balance offsets of channels 0, 1, 2
+    ToneCurve(int brightness, int contrast, int c0, int c1, int c2, float ga);
+
+    // brightness/contrast, before the Lab and HSV stages
+    bool preIdentity() const { return pre0; }
+    float pre(float x) const;
+
+    // colour balance of channel c, then gamma
+    bool postIdentity() const { return post0; }
+    float post(float x, int c) const;
+
+    // the same in place on a CV_32FC3 block, with OpenCV's vectorised
+    // arithmetic
+    void applyPre(cv::Mat& img) const;
+    void applyPost(cv::Mat& img) const;
+
+    // 65536-entry tables for 16-bit samples, pre is one table for all
+    // channels, post one per channel interleaved like a CV_16UC3 row
+    void preTable(std::vector<ushort>& table) const;
+    void postTable(std::vector<ushort>& table) const;
+
+private:
+    bool pre0, post0;
+    double B, k;
+    float offset[3];
+    float gamma;
+};
+
+// Lab or HSV offsets for float conversions, made from 8-bit units by
+// labShift and hsvShift; the default is no shift
+struct DeepShift
+{
+    int toCode, fromCode;
+    float d[3], lo[3], hi[3];
+
+    DeepShift() : toCode(0), fromCode(0)
+    {
+        for (int c = 0; c < 3; c++)
+            d[c] = lo[c] = hi[c] = 0;
+    }
+
+    bool isIdentity() const { return d[0] == 0 && d[1] == 0 && d[2] == 0; }
+};
+
+// Lab and HSV offsets of the chain for 16-bit and float images
+DeepShift labShift(int l, int a, int b);
+DeepShift hsvShift(int hue, int saturation, int ilumination);
+
+/**
+ * Composition of per-channel 8-bit maps
+ *
+ * adjustBrightnessContrast, ColorBalance and GammaCorrect only look at one
+ * channel value at a time, so any run of them folds into a single table of
+ * 256 entries per channel and costs one LUT pass however long the run is.
+ */
+class ChannelLut
+{
+public:
+    // identity map
+    ChannelLut();
+
+    // append a map applied after the current ones, next is a 1x256 CV_8U
+    // table used for all channels or a 1x256 CV_8UC3 table per channel
+    ChannelLut& then(const cv::Mat& next);
+
+    bool isIdentity() const;
+
+    // dst may be the same Mat as img
+    void apply(const cv::Mat& img, cv::Mat& dst) const;
+
+private:
+    uchar table[256*3];
+};
+
+/**
+ * Compiled adjustment chain
+ *
+ * Runs adjustBrightnessContrast -> AdjustLAB -> AdjustHSI -> ColorBalance
+ * -> GammaCorrect in a single pass over bands of rows, so each band stays in
+ * cache through all stages and only band-sized scratch buffers are
+ * allocated. Bands are spread over all threads. Consecutive per-channel
+ * stages are folded into one ChannelLut when the graph is built. Every stage
+ * is per pixel, so the output is identical to calling the functions one
+ * after another on the whole image.
+ *
+ * CV_16UC3 and CV_32FC3 images run the same chain through adjustDeep.
+ */
+class AdjustGraph
+{
+public:
+    explicit AdjustGraph(const AdjustParams& params, int tileBytes = 256*1024);
+
+    // dst may be the same Mat as img
+    void run(const cv::Mat& img, cv::Mat& dst) const;
+
+    // in place, each band is overwritten once all stages have run on it
+    void run(cv::Mat& img) const { run(img, img); }
+
+    /**
+     * Run the chain on part of the image only
+     *
+     * img is split into square tiles. Tiles where weight is 0 everywhere
+     * are copied without running any stage, tiles where it is 255
+     * everywhere are adjusted as in run(), and the rest are adjusted into a
+     * scratch tile and blended with blendRegion. When the region covers a
+     * small part of the frame most tiles take the copy path.
+     *
+     * @param weight [in] CV_8UC1 blend weights from regionWeight
+     * @param tileSize [in] tile edge in pixels
+     */
+    void runMasked(const cv::Mat& img, cv::Mat& dst, const cv::Mat& weight, int tileSize = 64) const;
+
+private:
+    enum StageKind { STAGE_LUT, STAGE_LAB, STAGE_HSV };
+
+    struct Stage
+    {
+        StageKind kind;
+        ChannelLut lut;
+        int d0, d1, d2;
+    };
+
+    void addLut(const cv::Mat& lut);
+    void addShift(StageKind kind, int d0, int d1, int d2);
+    void runStage(const Stage& stage, const cv::Mat& in, cv::Mat& out, cv::Mat& scratch) const;
+    void runStages(const cv::Mat& in, cv::Mat& out, cv::Mat& scratch) const;
+
+    std::vector<Stage> stages;
+    int tileBytes;
+
+    // the chain for 16-bit and float images
+    ToneCurve curve;
+    DeepShift lab, hsv;
+};
+
+/**
+ * 3D colour lookup table
+ *
+ * The Lab and HSV stages mix channels, so the full chain cannot be folded
+ * into ChannelLut. Instead it is sampled on an n*n*n lattice of BGR colours
+ * and pixels are interpolated between the surrounding lattice points, which
+ * replaces every cvtColor round trip with one lookup per pixel. The result
+ * is an approximation of AdjustGraph; 33 points per axis is usually closer
+ * than one level, 17 is faster to bake and 65 is the most accurate.
+ *
+ * The lattice is stored with red varying fastest, then green, then blue, as
+ * in .cube files, so it can be loaded from and saved to other tools.
+ */
+class ColorCube
+{
+public:
+    enum Interpolation { CUBE_TETRAHEDRAL, CUBE_TRILINEAR };
+
+    ColorCube();
+
+    // sample graph on a size^3 lattice, size is in [2, 256]
+    void bake(const AdjustGraph& graph, int size = 33);
+
+    bool empty() const { return n == 0; }
+    int size() const { return n; }
+
+    // img is CV_8UC3 BGR, dst may be the same Mat as img
+    void apply(const cv::Mat& img, cv::Mat& dst, int interpolation = CUBE_TETRAHEDRAL) const;
+
+    // .cube (Adobe/Resolve) text format, 3D tables only
+    bool load(const std::string& filename);
+    bool save(const std::string& filename, const std::string& title = "imgAdjust") const;
+
+private:
+    int n;
+    std::vector<float> lattice;  // BGR output in [0, 255] per lattice point
+};
+
+/**
+ * Incremental renderer for the interactive tool
+ *
+ * Keeps the output of the brightness/contrast, Lab and HSV stages of the
+ * last render. When only some sliders moved, rendering resumes from the
+ * first stage whose parameters changed; colour balance and gamma are one
+ * folded LUT pass over the cached HSV output, so dragging them never
+ * touches the colour conversions. Costs three frames of memory.
+ */
+class AdjustCache
+{
+public:
+    AdjustCache() : srcData(0), done(0) {}
+
+    // dst must not be one of the cached stage outputs
+    void render(const cv::Mat& img, const AdjustParams& p, cv::Mat& dst);
+
+    // drop all stage outputs, e.g. when the source image is replaced
+    void clear() { done = 0; }
+
+private:
+    const uchar* srcData;
+    cv::Size srcSize;
+    AdjustParams last;
+    int done;          // number of valid stage outputs
+    cv::Mat bc, lab, hsv;
+};
+
+
+//===== statistics ====
+
+// Skin/red region of a CV_8UC3 image as a CV_8UC1 mask, 255 inside
+int getMask(const cv::Mat& img, cv::Mat& mask);
+
+/**
+ * getMask of the last source image
+ *
+ * The mask depends only on the unadjusted image, so it is built once per
+ * image and shared by the statistics and masked adjustments of every
+ * render. The image is identified by its buffer and size; call clear()
+ * if pixels are changed in place.
+ */
+class MaskCache
+{
+public:
+    MaskCache() : data(0) {}
+
+    const cv::Mat& get(const cv::Mat& img)
+    {
+        if (img.data != data || img.size() != size || mask.empty())
+        {
+            getMask(img, mask);
+            data = img.data;
+            size = img.size();
+        }
+        return mask;
+    }
+
+    void clear() { mask.release(); }
+
+private:
+    const uchar* data;
+    cv::Size size;
+    cv::Mat mask;
+};
+
+// Means of an adjusted image over the getMask region of its source, in the
+// units cv::mean gives for BGR, CV_BGR2Lab and CV_BGR2HSV 8-bit images
+struct AdjustStats
+{
+    float rgb[3];       // R, G, B
+    float lab[3];
+    float hsv[3];
+    long long count;    // pixels inside the mask that were visited
+
+    // 95% confidence half-width of each mean, 0 when every pixel was visited
+    float rgbErr[3];
+    float labErr[3];
+    float hsvErr[3];
+};
+
+// per band: B G R L A B H S V sums, the same squared, masked pixel count
+enum { STATS_SUMS = 19 };
+
+// sums of addStats can be added up over pieces of an image, statsFromSums
+// turns them into the getStats result
+void addStats(const cv::Mat& img, const cv::Mat& mask, int step, long long* total);
+AdjustStats statsFromSums(const long long* total, int step);
+
+AdjustStats getStats(const cv::Mat& img, const cv::Mat& mask, int step = 1);
+int statsStep(const cv::Mat& img, double budget = 65536);
+
+}  // namespace imgadjust
+
+#ifdef IMGADJUST_PROFILE
+#define IMGADJUST_PROFILE_CONCAT2(a, b)  a##b
+#define IMGADJUST_PROFILE_CONCAT(a, b)  IMGADJUST_PROFILE_CONCAT2(a, b)
+#define IMGADJUST_PROFILE_SCOPE(name)  imgadjust::ProfileScope IMGADJUST_PROFILE_CONCAT(profileScope, __LINE__)(name)
+#define IMGADJUST_PROFILE_OVERLAY(img)  do { if (imgadjust::profiler().overlay) imgadjust::profiler().draw(img); } while(0)
+#define IMGADJUST_PROFILE_REPORT()  imgadjust::profiler().report()
+#else
+#define IMGADJUST_PROFILE_SCOPE(name)
+#define IMGADJUST_PROFILE_OVERLAY(img)  do {} while(0)
+#define IMGADJUST_PROFILE_REPORT()  do {} while(0)
+#endif
+
+#endif